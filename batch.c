@@ -0,0 +1,155 @@
+#include "proj1.h"
+#include "statemachine.h"
+#include "macros.h"
+#include "expander.h"
+#include "batch.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* One document of a batch */
+typedef struct {
+    char* input;
+    char* output;
+    off_t size;
+} job_t;
+
+/* Jobs shared by the worker pool; NEXT is the first job nobody has taken */
+typedef struct {
+    preamble_t* preamble;
+    job_t* jobs;
+    size_t count;
+    atomic_size_t next;
+    atomic_int failures;
+} batch_t;
+
+/* Orders jobs largest input first, so big documents start early */
+static int compareJobs(const void* a, const void* b) {
+    off_t x = ((const job_t*) a)->size;
+    off_t y = ((const job_t*) b)->size;
+    return (x < y) - (x > y);
+}
+
+/* Expand one document into its output file with a macro table of its own,
+layered over the preamble if there is one; returns false and reports why if
+it fails */
+static bool runJob(job_t* job, preamble_t* preamble) {
+    trap_t here;
+    expander_t* ctx = createExpander(preamble ? preamble->macros : NULL);
+    source_t* input = createSource(&job->input, 1);
+    FILE* volatile out = NULL;
+    sink_t* volatile output = NULL;
+    bool ok = true;
+
+    trap = &here;
+    if (setjmp(here.env) == 0) {
+        if ((out = fopen(job->output, "w")) == NULL) {
+            DIE("%s", "Cannot open output file.");
+        }
+        output = createFileSink(out);
+        if (preamble) {
+            sinkBytes(output, preamble->output->data, preamble->output->size);
+        }
+        if (!validEnd(expandSource(ctx, input, output))) {
+            DIE("%s", "invalid end");
+        }
+        destroySink(output);
+        output = NULL;
+        if (fclose(out) != 0) {
+            out = NULL;
+            DIE("%s", "Cannot write output.");
+        }
+        out = NULL;
+    } else {
+        WARN("%s: %s", job->input, here.message);
+        ok = false;
+    }
+    trap = NULL;
+
+    /* Discard what a failed document had written so far */
+    if (output) {
+        output->buffer->size = 0;
+        destroySink(output);
+    }
+    if (out) {
+        fclose(out);
+    }
+    if (!ok) {
+        remove(job->output);
+    }
+    destroySource(input);
+    destroyExpander(ctx);
+    return ok;
+}
+
+/* Worker loop: keep taking the next unclaimed job until none are left */
+static void* worker(void* arg) {
+    batch_t* batch = arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&batch->next, 1)) < batch->count) {
+        if (!runJob(&batch->jobs[i], batch->preamble)) {
+            atomic_fetch_add(&batch->failures, 1);
+        }
+    }
+    return NULL;
+}
+
+/* Expand every INPUT OUTPUT pair listed in the manifest file, one document
+per job, on JOBS threads (one per core if JOBS is 0), sharing PREAMBLE if it
+is not NULL; returns how many documents failed */
+int runBatch(char* manifest, int jobs, preamble_t* preamble) {
+    string_t* text = createString();
+    appendFile(text, manifest);
+
+    /* Split the manifest into whitespace separated pairs in place */
+    batch_t batch;
+    batch.preamble = preamble;
+    size_t capacity = 8;
+    batch.jobs = malloc(capacity * sizeof(job_t));
+    batch.count = 0;
+    char* save;
+    char* input = strtok_r(text->data, " \t\r\n", &save);
+    while (input != NULL) {
+        char* output = strtok_r(NULL, " \t\r\n", &save);
+        if (output == NULL) {
+            DIE("%s", "Manifest lists an input without an output.");
+        }
+        struct stat st;
+        batch.jobs[batch.count].input = input;
+        batch.jobs[batch.count].output = output;
+        batch.jobs[batch.count].size = stat(input, &st) == 0 ? st.st_size : 0;
+        batch.count++;
+        if (batch.count >= capacity) {
+            batch.jobs = DOUBLE(batch.jobs, capacity);
+        }
+        input = strtok_r(NULL, " \t\r\n", &save);
+    }
+    qsort(batch.jobs, batch.count, sizeof(job_t), compareJobs);
+    atomic_init(&batch.next, 0);
+    atomic_init(&batch.failures, 0);
+
+    /* Start the pool; the calling thread works as one of its members */
+    if (jobs <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cores > 0 ? cores : 1;
+    }
+    if ((size_t) jobs > batch.count) {
+        jobs = batch.count > 0 ? batch.count : 1;
+    }
+    pthread_t* threads = malloc(jobs * sizeof(pthread_t));
+    for (int i = 1; i < jobs; i++) {
+        if (pthread_create(&threads[i], NULL, worker, &batch) != 0) {
+            DIE("%s", "Cannot start worker thread.");
+        }
+    }
+    worker(&batch);
+    for (int i = 1; i < jobs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+    free(batch.jobs);
+    destroyString(text);
+    return atomic_load(&batch.failures);
+}
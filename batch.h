@@ -0,0 +1,5 @@
+/* ----------------------------------------------------------------------------
+Batch Mode
+---------------------------------------------------------------------------- */
+
+int runBatch(char* manifest, int jobs, preamble_t* preamble);
@@ -0,0 +1,39 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+/* Preloaded into a benchmarked process to count its calls to the allocator,
+which are written to the file named by BENCH_ALLOCS when it exits */
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static atomic_long allocations;
+
+void* malloc(size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+/* Reports the count once the process is done */
+__attribute__((destructor)) static void report(void) {
+    long count = atomic_load(&allocations);
+    const char* path = getenv("BENCH_ALLOCS");
+    FILE* fp = path ? fopen(path, "w") : NULL;
+    if(fp) {
+        fprintf(fp, "%ld\n", count);
+        fclose(fp);
+    }
+}
@@ -0,0 +1,295 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "proj1.h"
+#include "statemachine.h"
+#include "macros.h"
+
+#define MICRO_TARGET 20000000 // Nanoseconds each repetition aims to take
+#define MICRO_REPEAT 7        // Timed repetitions after the warm-up
+
+/* Runs N operations of a benchmark on its STATE */
+typedef void (*body_t)(void* state, size_t n);
+
+/* Cycle counter where there is one, else 0 */
+static unsigned long long cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* Orders doubles for qsort */
+static int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/* Times BODY: a warm-up that also picks how many operations make up one
+repetition, then MICRO_REPEAT repetitions, reporting the minimum, median and
+maximum ns/op, and cycles/byte of the median if each op handles BYTES bytes */
+static void measure(const char* name, body_t body, void* state, size_t bytes) {
+    size_t n = 1;
+    double elapsed;
+    do {
+        n *= 2;
+        double start = monotonicClock();
+        body(state, n);
+        elapsed = monotonicClock() - start;
+    } while(elapsed < MICRO_TARGET / 4 && n < (1UL << 40));
+    n = n * MICRO_TARGET / (elapsed > 0 ? elapsed : 1) + 1;
+
+    double ns[MICRO_REPEAT], cpb[MICRO_REPEAT];
+    for(int r = 0; r < MICRO_REPEAT; r++) {
+        unsigned long long c = cycles();
+        double start = monotonicClock();
+        body(state, n);
+        ns[r] = (monotonicClock() - start) / n;
+        cpb[r] = bytes ? (double) (cycles() - c) / n / bytes : 0;
+    }
+    qsort(ns, MICRO_REPEAT, sizeof(double), compareDoubles);
+    qsort(cpb, MICRO_REPEAT, sizeof(double), compareDoubles);
+
+    printf("%-28s %10.2f %10.2f %10.2f", name, ns[0], ns[MICRO_REPEAT / 2], ns[MICRO_REPEAT - 1]);
+    if(bytes) {
+        printf(" %12.3f", cpb[MICRO_REPEAT / 2]);
+    }
+    printf("\n");
+}
+
+/* ----------------------------------------------------------------------------
+State Machine
+---------------------------------------------------------------------------- */
+
+typedef struct {
+    const char* data;
+    size_t size;
+} stream_t;
+
+/* Ticks through the whole stream, giving a call one argument once it opens */
+static void tickStream(void* state, size_t n) {
+    stream_t* s = state;
+    parser_t parser;
+    int arg_max = 0;
+    initParser(&parser);
+    for(size_t k = 0; k < n; k++) {
+        for(size_t i = 0; i < s->size; i++) {
+            state_t t = tick(&parser, s->data[i], arg_max);
+            if(t == state_argument1_begin) {
+                arg_max = 1;
+            } else if(t == state_macro_end) {
+                arg_max = 0;
+            }
+        }
+    }
+}
+
+/* ----------------------------------------------------------------------------
+String Helpers
+---------------------------------------------------------------------------- */
+
+typedef struct {
+    string_t* target;
+    string_t* source;
+    size_t size;
+} strings_t;
+
+/* Builds a string of SIZE characters one addChar at a time */
+static void addChars(void* state, size_t n) {
+    strings_t* s = state;
+    for(size_t k = 0; k < n; k++) {
+        clearString(s->target);
+        for(size_t i = 0; i < s->size; i++) {
+            addChar(s->target, 'x');
+        }
+    }
+}
+
+/* Appends a SIZE character string to an emptied one */
+static void appendStrings(void* state, size_t n) {
+    strings_t* s = state;
+    for(size_t k = 0; k < n; k++) {
+        clearString(s->target);
+        appendString(s->target, s->source);
+    }
+}
+
+/* Copies a SIZE character string into a new one and destroys it */
+static void copyStrings(void* state, size_t n) {
+    strings_t* s = state;
+    for(size_t k = 0; k < n; k++) {
+        destroyString(copyString(s->source));
+    }
+}
+
+/* ----------------------------------------------------------------------------
+Macro Helpers
+---------------------------------------------------------------------------- */
+
+typedef struct {
+    macro_list_t* ml;
+    string_t** names;
+    size_t count;
+    string_t* arg;
+    string_t* expansion;
+} macros_t;
+
+/* Fills a table with COUNT macros named m0, m1, ... each defined as DEF */
+static void fillMacros(macros_t* m, size_t count, const char* def) {
+    m->ml = createMacroList();
+    m->names = malloc(count * sizeof(string_t*));
+    m->count = count;
+    m->arg = createString();
+    appendBytes(m->arg, "argument", 8);
+    m->expansion = createString();
+    string_t* d = createString();
+    appendBytes(d, def, strlen(def));
+    for(size_t i = 0; i < count; i++) {
+        char name[32];
+        m->names[i] = createString();
+        appendBytes(m->names[i], name, snprintf(name, sizeof name, "m%zu", i));
+        macro_def(m->ml, m->names[i], d);
+    }
+    destroyString(d);
+}
+
+/* Frees what fillMacros built */
+static void freeMacros(macros_t* m) {
+    for(size_t i = 0; i < m->count; i++) {
+        destroyString(m->names[i]);
+    }
+    free(m->names);
+    destroyString(m->arg);
+    destroyString(m->expansion);
+    destroyMacroList(m->ml);
+}
+
+/* Looks up the macros in a scattered order */
+static void locateMacros(void* state, size_t n) {
+    macros_t* m = state;
+    size_t i = 0;
+    for(size_t k = 0; k < n; k++) {
+        i = (i + 7919) % m->count;
+        if(macro_locate(m->ml, m->names[i]) == NULL) {
+            abort();
+        }
+    }
+}
+
+/* Expands the first macro into an emptied expansion */
+static void expandMacros(void* state, size_t n) {
+    macros_t* m = state;
+    for(size_t k = 0; k < n; k++) {
+        clearString(m->expansion);
+        macro_expand(m->ml, m->names[0], hashString(m->names[0]), m->arg, m->expansion);
+    }
+}
+
+/* ----------------------------------------------------------------------------
+Stack Helpers
+---------------------------------------------------------------------------- */
+
+/* Pushes and pops a borrowed entry */
+static void churnBorrowed(void* state, size_t n) {
+    stack_t* stack = state;
+    for(size_t k = 0; k < n; k++) {
+        pushBorrowed(stack, "text", 4);
+        pop(stack);
+    }
+}
+
+/* Pushes and pops an owned string taken from the stack */
+static void churnOwned(void* state, size_t n) {
+    stack_t* stack = state;
+    for(size_t k = 0; k < n; k++) {
+        string_t* s = takeString(stack);
+        addChar(s, 'x');
+        pushOwned(stack, s);
+        pop(stack);
+    }
+}
+
+/* Pushes 64 nested entries, then pops them all */
+static void churnDeep(void* state, size_t n) {
+    stack_t* stack = state;
+    for(size_t k = 0; k < n; k++) {
+        for(int d = 0; d < 64; d++) {
+            pushBorrowed(stack, "text", 4);
+        }
+        for(int d = 0; d < 64; d++) {
+            pop(stack);
+        }
+    }
+}
+
+/* Run every component benchmark, one line each */
+int main(void) {
+    printf("%-28s %10s %10s %10s %12s\n", "benchmark", "min ns/op", "med ns/op", "max ns/op", "cycles/byte");
+
+    /* State machine over prose, and over back-to-back macro calls */
+    static char prose[4096], calls[4096];
+    for(size_t i = 0; i < sizeof prose; i++) {
+        prose[i] = "the macro processor reads plain text\n"[i % 37];
+        calls[i] = "\\name{argument} "[i % 16];
+    }
+    stream_t s = { prose, sizeof prose };
+    measure("tick/prose-4k", tickStream, &s, sizeof prose);
+    s.data = calls;
+    measure("tick/calls-4k", tickStream, &s, sizeof calls);
+
+    /* String helpers across the inline and heap sizes */
+    size_t sizes[] = { 8, 32, 256, 4096, 65536 };
+    for(size_t i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+        strings_t st = { createString(), createString(), sizes[i] };
+        for(size_t j = 0; j < sizes[i]; j++) {
+            addChar(st.source, 'y');
+        }
+        char name[64];
+        snprintf(name, sizeof name, "addChar/%zu", sizes[i]);
+        measure(name, addChars, &st, sizes[i]);
+        snprintf(name, sizeof name, "appendString/%zu", sizes[i]);
+        measure(name, appendStrings, &st, sizes[i]);
+        snprintf(name, sizeof name, "copyString/%zu", sizes[i]);
+        measure(name, copyStrings, &st, sizes[i]);
+        destroyString(st.target);
+        destroyString(st.source);
+    }
+
+    /* Lookup across table sizes */
+    size_t counts[] = { 10, 100, 1000, 10000, 100000 };
+    for(size_t i = 0; i < sizeof counts / sizeof counts[0]; i++) {
+        macros_t m;
+        fillMacros(&m, counts[i], "definition");
+        char name[64];
+        snprintf(name, sizeof name, "macro_locate/%zu", counts[i]);
+        measure(name, locateMacros, &m, 0);
+        freeMacros(&m);
+    }
+
+    /* Expansion with more and more parameters */
+    const char* defs[] = { "a plain definition",
+        "before # after", "#, #, #, #", "################" };
+    int params[] = { 0, 1, 4, 16 };
+    for(size_t i = 0; i < sizeof defs / sizeof defs[0]; i++) {
+        macros_t m;
+        fillMacros(&m, 1, defs[i]);
+        char name[64];
+        snprintf(name, sizeof name, "macro_expand/%d#", params[i]);
+        measure(name, expandMacros, &m, 0);
+        freeMacros(&m);
+    }
+
+    /* Push and pop churn */
+    stack_t* stack = createStack();
+    measure("push-pop/borrowed", churnBorrowed, stack, 0);
+    measure("push-pop/owned", churnOwned, stack, 0);
+    measure("push-pop/depth-64", churnDeep, stack, 0);
+    destroyStack(stack);
+    return 0;
+}
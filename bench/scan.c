@@ -0,0 +1,74 @@
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "scan.h"
+
+#define BENCH_SIZE (64 << 20) // Bytes of generated prose
+#define BENCH_REPEAT 5        // Passes over the prose per scanner
+
+typedef size_t (*scanner_t)(const char*, size_t, char, char);
+
+/* Fills BUF with prose: words and punctuation, with a macro call, escape or
+comment roughly every few hundred bytes */
+static void generateProse(char* buf, size_t size) {
+    static const char* words[] = {"the", "macro", "processor", "reads", "plain",
+        "text", "and", "copies", "it", "through", "unchanged", "while", "a",
+        "few", "calls", "expand", "into", "definitions,", "sentences."};
+    size_t nwords = sizeof(words) / sizeof(words[0]);
+    unsigned seed = 12345;
+    size_t i = 0;
+    while(i < size) {
+        seed = seed * 1103515245 + 12345;
+        const char* w = words[(seed >> 16) % nwords];
+        if((seed >> 8) % 64 == 0) {
+            w = (seed >> 4) % 2 ? "\\name{arg}" : "% a comment\n";
+        }
+        size_t n = strlen(w);
+        for(size_t j = 0; j < n && i < size; j++) {
+            buf[i++] = w[j];
+        }
+        if(i < size) {
+            buf[i++] = (seed >> 20) % 12 == 0 ? '\n' : ' ';
+        }
+    }
+}
+
+/* Walks the whole buffer run by run the way expand() does, returning MB/s */
+static double measure(scanner_t scan, const char* buf, size_t size, size_t* runs) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    *runs = 0;
+    for(int r = 0; r < BENCH_REPEAT; r++) {
+        size_t i = 0;
+        while(i < size) {
+            i += scan(buf + i, size - i, '\\', '%') + 1;
+            (*runs)++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return (double) size * BENCH_REPEAT / seconds / 1e6;
+}
+
+/* Compare the scalar scanner against the vectorized one on prose */
+int main(void) {
+    char* buf = malloc(BENCH_SIZE);
+    generateProse(buf, BENCH_SIZE);
+
+    size_t scalar_runs, vector_runs;
+    double scalar = measure(scanUntilScalar, buf, BENCH_SIZE, &scalar_runs);
+    double vector = measure(scanUntil, buf, BENCH_SIZE, &vector_runs);
+    if(scalar_runs != vector_runs) {
+        fprintf(stderr, "scan: scanners disagree\n");
+        return 1;
+    }
+
+    printf("prose bytes: %d, runs per pass: %zu\n", BENCH_SIZE, scalar_runs / BENCH_REPEAT);
+    printf("scalar: %.1f MB/s\n", scalar);
+    printf("vector: %.1f MB/s (%.2fx)\n", vector, vector / scalar);
+
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define BENCH_REPEAT 3 // Runs per workload; the fastest one is reported
+
+/* Writes one kind of document to FP at roughly SCALE megabytes, returning
+how many macro calls expanding it makes; include files go in DIR */
+typedef size_t (*generator_t)(FILE* fp, const char* dir, size_t scale);
+
+/* Next pseudo-random number, the same on every run */
+static unsigned next(unsigned* seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+/* Writes about SIZE bytes of words with punctuation and line breaks */
+static void writeWords(FILE* fp, size_t size, unsigned* seed) {
+    static const char* words[] = {"the", "macro", "processor", "reads", "plain",
+        "text", "and", "copies", "it", "through", "unchanged", "while", "a",
+        "few", "calls", "expand", "into", "definitions,", "sentences."};
+    size_t nwords = sizeof(words) / sizeof(words[0]);
+    for(size_t i = 0; i < size; ) {
+        unsigned r = next(seed);
+        i += fprintf(fp, "%s%c", words[r % nwords], r % 12 == 0 ? '\n' : ' ');
+    }
+}
+
+/* Prose with the odd escaped character and nothing else */
+static size_t generateProse(FILE* fp, const char* dir, size_t scale) {
+    unsigned seed = 1;
+    for(size_t i = 0; i < scale * 1024; i++) {
+        writeWords(fp, 1000, &seed);
+        fputs(next(&seed) % 2 ? "\\{" : "\\\\", fp);
+    }
+    return 0;
+}
+
+/* A table of 16k macros, each called in turn at random */
+static size_t generateWide(FILE* fp, const char* dir, size_t scale) {
+    size_t defs = 16384;
+    size_t calls = scale * 64 * 1024;
+    unsigned seed = 2;
+    for(size_t i = 0; i < defs; i++) {
+        fprintf(fp, "\\def{m%zu}{<#:%zu>}\n", i, i);
+    }
+    for(size_t i = 0; i < calls; i++) {
+        fprintf(fp, "\\m%u{x} ", next(&seed) % (unsigned) defs);
+    }
+    return defs + calls;
+}
+
+/* The README's self-recursive \list over long argument lists */
+static size_t generateRecursion(FILE* fp, const char* dir, size_t scale) {
+    size_t items = scale * 128 * 1024;
+    fputs("\\def{list}{\\if{#}{#, \\list}{..., omega}}\n", fp);
+    for(size_t i = 0; i < items; ) {
+        fputs("\\list", fp);
+        for(size_t j = 0; j < 1000 && i < items; j++, i++) {
+            fprintf(fp, "{a%zu}", j);
+        }
+        fputs("{}\n", fp);
+    }
+
+    /* Each item takes a \list and an \if, as does the empty argument */
+    return 2 * items + 2 * (items + 999) / 1000 + 1;
+}
+
+/* Chains of \expandafter nested a few deep around user macro calls */
+static size_t generateExpandafter(FILE* fp, const char* dir, size_t scale) {
+    size_t chains = scale * 8 * 1024;
+    size_t depth = 8;
+    fputs("\\def{w}{[#]}\n", fp);
+    for(size_t i = 0; i < chains; i++) {
+        for(size_t j = 0; j < depth; j++) {
+            fputs("\\expandafter{b}{", fp);
+        }
+        fputs("\\w{x}", fp);
+        for(size_t j = 0; j < depth; j++) {
+            fputc('}', fp);
+        }
+        fputc('\n', fp);
+    }
+    return 1 + chains * (depth + 1);
+}
+
+/* A page of prose included over and over */
+static size_t generateInclude(FILE* fp, const char* dir, size_t scale) {
+    char path[4096];
+    snprintf(path, sizeof path, "%s/snippet.tex", dir);
+    FILE* snippet = fopen(path, "w");
+    if(snippet == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    unsigned seed = 5;
+    writeWords(snippet, 2000, &seed);
+    fclose(snippet);
+
+    size_t includes = scale * 2048;
+    for(size_t i = 0; i < includes; i++) {
+        fprintf(fp, "\\include{%s}\n", path);
+    }
+    return includes;
+}
+
+/* Short lines of text, most of them ending in a comment */
+static size_t generateComments(FILE* fp, const char* dir, size_t scale) {
+    unsigned seed = 6;
+    for(size_t i = 0; i < scale * 16 * 1024; i++) {
+        writeWords(fp, 20, &seed);
+        fputs("% ", fp);
+        writeWords(fp, 40, &seed);
+        fputc('\n', fp);
+    }
+    return 0;
+}
+
+static const struct {
+    const char* name;
+    generator_t generate;
+} workloads[] = {
+    {"prose", generateProse},
+    {"wide", generateWide},
+    {"recursion", generateRecursion},
+    {"expandafter", generateExpandafter},
+    {"include", generateInclude},
+    {"comments", generateComments},
+};
+
+/* Runs PROJ1 on INPUT once with the allocation counter preloaded, returning
+the wall time in seconds and setting its peak RSS and allocation count */
+static double run(const char* proj1, const char* counter, const char* input,
+    const char* allocs, long* rss, long* count) {
+    struct timespec start, end;
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if(pid == 0) {
+        if(freopen("/dev/null", "w", stdout) == NULL) {
+            _exit(127);
+        }
+        setenv("LD_PRELOAD", counter, 1);
+        setenv("BENCH_ALLOCS", allocs, 1);
+        execl(proj1, proj1, input, (char*) NULL);
+        _exit(127);
+    }
+    int status;
+    struct rusage usage;
+    if(pid < 0 || wait4(pid, &status, 0, &usage) != pid
+    || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s failed on %s\n", proj1, input);
+        exit(EXIT_FAILURE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    *rss = usage.ru_maxrss;
+    *count = -1;
+    FILE* fp = fopen(allocs, "r");
+    if(fp) {
+        if(fscanf(fp, "%ld", count) != 1) {
+            *count = -1;
+        }
+        fclose(fp);
+    }
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/* Generate each workload and expand it with PROJ1, printing one JSON object
+per workload: usage: suite PROJ1 COUNTER [SCALE] [WORKLOAD]... */
+int main(int argc, char** argv) {
+    if(argc < 3) {
+        fprintf(stderr, "usage: suite PROJ1 COUNTER [SCALE] [WORKLOAD]...\n");
+        return EXIT_FAILURE;
+    }
+    char proj1[4096], counter[4096];
+    if(realpath(argv[1], proj1) == NULL || realpath(argv[2], counter) == NULL) {
+        perror("realpath");
+        return EXIT_FAILURE;
+    }
+    size_t scale = argc > 3 ? strtoul(argv[3], NULL, 10) : 4;
+
+    char dir[] = "/tmp/texmacro-bench-XXXXXX";
+    if(mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    char input[4096], allocs[4096];
+    snprintf(input, sizeof input, "%s/input.tex", dir);
+    snprintf(allocs, sizeof allocs, "%s/allocs", dir);
+
+    printf("[\n");
+    size_t count = sizeof(workloads) / sizeof(workloads[0]);
+    bool first = true;
+    for(size_t i = 0; i < count; i++) {
+        bool wanted = argc <= 4;
+        for(int j = 4; j < argc; j++) {
+            wanted |= !strcmp(argv[j], workloads[i].name);
+        }
+        if(!wanted) {
+            continue;
+        }
+
+        FILE* fp = fopen(input, "w");
+        if(fp == NULL) {
+            perror(input);
+            return EXIT_FAILURE;
+        }
+        size_t calls = workloads[i].generate(fp, dir, scale);
+        long bytes = ftell(fp);
+        fclose(fp);
+
+        double best = 0;
+        long rss = 0, allocations = 0;
+        for(int r = 0; r < BENCH_REPEAT; r++) {
+            long run_rss, run_allocations;
+            double seconds = run(proj1, counter, input, allocs, &run_rss, &run_allocations);
+            if(r == 0 || seconds < best) {
+                best = seconds;
+            }
+            rss = run_rss > rss ? run_rss : rss;
+            allocations = run_allocations;
+        }
+
+        printf("%s  {\"workload\": \"%s\", \"bytes\": %ld, \"calls\": %zu, "
+            "\"seconds\": %.6f, \"mb_per_s\": %.2f, \"calls_per_s\": %.0f, "
+            "\"peak_rss_kb\": %ld, \"allocations\": %ld}",
+            first ? "" : ",\n", workloads[i].name, bytes, calls, best,
+            bytes / best / 1e6, calls / best, rss, allocations);
+        fflush(stdout);
+        first = false;
+    }
+    printf("\n]\n");
+
+    remove(input);
+    remove(allocs);
+    char snippet[4096];
+    snprintf(snippet, sizeof snippet, "%s/snippet.tex", dir);
+    remove(snippet);
+    rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,539 @@
+#include "proj1.h"
+#include "statemachine.h"
+#include "macros.h"
+#include "expander.h"
+#include "scan.h"
+#include "stats.h"
+#include "trace.h"
+#include <stdbool.h>
+#include <string.h>
+
+/* Initialize an expander with a fresh parser and scratch buffers, expanding
+macros from ML; an expander made this way does not own ML */
+expander_t* createExpanderFor(macro_list_t* ml) {
+    expander_t* ctx = malloc(sizeof(expander_t));
+    initParser(&ctx->parser);
+    ctx->macros = ml;
+    ctx->owns_macros = false;
+    initString(&ctx->macro_name);
+    ctx->macro_hash = HASH_INIT;
+    ctx->builtin = builtin_none;
+    initString(&ctx->arg1);
+    initString(&ctx->arg2);
+    initString(&ctx->arg3);
+    ctx->expansion = createString();
+    ctx->arg_count = 0;
+    ctx->stack = NULL;
+    ctx->frames = NULL;
+    ctx->frame_count = 0;
+    ctx->frame_capacity = 0;
+    ctx->stats = NULL;
+    ctx->trace = NULL;
+    return ctx;
+}
+
+/* Initialize an expander with a macro table of its own, layered as an
+overlay on the frozen table BASE unless BASE is NULL */
+expander_t* createExpander(macro_list_t* base) {
+    expander_t* ctx = createExpanderFor(base ? createOverlay(base) : createMacroList());
+    ctx->owns_macros = true;
+    return ctx;
+}
+
+/* Destroy the strings of any \expandafter left unfinished by a failure */
+static void dropFrames(expander_t* ctx) {
+    while (ctx->frame_count > 0) {
+        frame_t* frame = &ctx->frames[--ctx->frame_count];
+        destroyString(frame->before);
+        destroyString(frame->output.buffer);
+    }
+}
+
+/* Destroy an expander, and its macro table if it owns it */
+void destroyExpander(expander_t* ctx) {
+    dropFrames(ctx);
+    free(ctx->frames);
+    finishString(&ctx->macro_name);
+    finishString(&ctx->arg1);
+    finishString(&ctx->arg2);
+    finishString(&ctx->arg3);
+    destroyString(ctx->expansion);
+    if (ctx->stack) {
+        destroyStack(ctx->stack);
+    }
+    if (ctx->owns_macros) {
+        destroyMacroList(ctx->macros);
+    }
+    if (ctx->stats) {
+        destroyStats(ctx->stats);
+    }
+    if (ctx->trace) {
+        destroyTrace(ctx->trace);
+    }
+    free(ctx);
+}
+
+/* Return an expander to the state of a fresh one but for its macros, after a
+document that may have failed part way through */
+void resetExpander(expander_t* ctx) {
+    initParser(&ctx->parser);
+    clearString(&ctx->macro_name);
+    ctx->macro_hash = HASH_INIT;
+    clearString(&ctx->arg1);
+    clearString(&ctx->arg2);
+    clearString(&ctx->arg3);
+    clearString(ctx->expansion);
+    ctx->arg_count = 0;
+    dropFrames(ctx);
+    if (ctx->stack) {
+        destroyStack(ctx->stack);
+        ctx->stack = NULL;
+    }
+    if (ctx->stats) {
+        statsUnwind(ctx->stats);
+    }
+    if (ctx->trace) {
+        traceUnwind(ctx->trace);
+    }
+}
+
+/* Checks whether input may end in the given state */
+bool validEnd(state_t state) {
+    return state == state_plaintext || state == state_comment || state == state_after_comment
+    || state == state_macro_end || state == state_not_alpha_or_escape;
+}
+
+/* Resolves a macro name to the builtin it names, if any, with a switch on its
+first byte and length so that at most one comparison confirms it */
+static builtin_t findBuiltin(string_t* name) {
+    const char* s = name->data;
+    switch (s[0]) {
+        case 'd':
+            return name->size == 3 && !memcmp(s, "def", 3) ? builtin_def : builtin_none;
+        case 'u':
+            return name->size == 5 && !memcmp(s, "undef", 5) ? builtin_undef : builtin_none;
+        case 'e':
+            return name->size == 11 && !memcmp(s, "expandafter", 11) ? builtin_expandafter : builtin_none;
+        case 'i':
+            switch (name->size) {
+                case 2:
+                    return s[1] == 'f' ? builtin_if : builtin_none;
+                case 5:
+                    return !memcmp(s, "ifdef", 5) ? builtin_ifdef : builtin_none;
+                case 7:
+                    return !memcmp(s, "include", 7) ? builtin_include : builtin_none;
+            }
+    }
+    return builtin_none;
+}
+
+/* Finds the correct number of arguments for a call to a builtin, or to a user
+macro if BUILTIN is builtin_none */
+static int findArgCount(builtin_t builtin) {
+    switch (builtin) {
+        case builtin_def:
+        case builtin_expandafter:
+            return 2;
+        case builtin_if:
+        case builtin_ifdef:
+            return 3;
+        default:
+            return 1;
+    }
+}
+
+/* Macro processing function which reads macro name and arguments and expands
+into the expansion string or performs built in macros */
+static void processMacro(expander_t* ctx, stack_t* es) {
+    string_t* arg1 = &ctx->arg1;
+    string_t* arg2 = &ctx->arg2;
+    string_t* arg3 = &ctx->arg3;
+    string_t* expansion = ctx->expansion;
+    macro_list_t* ml = ctx->macros;
+
+    switch (ctx->builtin) {
+        case builtin_def:
+            macro_def(ml, arg1, arg2);
+            break;
+        case builtin_undef:
+            macro_undef(ml, arg1);
+            break;
+        case builtin_if:
+            if(arg1->size != 0) {
+                appendString(expansion, arg2);
+            } else {
+                appendString(expansion, arg3);
+            }
+            break;
+        case builtin_ifdef:
+            if(macro_locate(ml, arg1) != NULL) {
+                appendString(expansion, arg2);
+            } else {
+                appendString(expansion, arg3);
+            }
+            break;
+        case builtin_include:
+            /* Large files are scanned in place, smaller ones come from the cache */
+            if (!pushFile(es, arg1->data)) {
+                appendInclude(expansion, arg1->data);
+            }
+            break;
+        default: {
+            /* Definitions without parameters are read in place off the stack;
+            the name was hashed as it was read */
+            macro_t* m = macro_expand(ml, &ctx->macro_name, ctx->macro_hash, arg1, expansion);
+            if (m && m->definition_size > 0) {
+                pushMacro(es, m);
+            }
+        }
+    }
+}
+
+/* Pop the top entry of ES, ending the timed and traced calls it holds the
+expansion of, if any */
+static void popEntry(expander_t* ctx, stack_t* es) {
+    if (ctx->stats) {
+        statsPop(ctx->stats, es->depth);
+    }
+    if (ctx->trace) {
+        tracePop(ctx->trace, es->depth);
+    }
+    pop(es);
+}
+
+/* Process the macro call just read with PROCESS, counting the call, the time
+processing it takes and, but for an \expandafter, whose expansion is only
+complete once its frame is left, the bytes it expands to: in the expansion, or
+in place in a new stack entry. Its total time and its trace span last until
+the entry its expansion goes into, pushed here or by the caller, is popped */
+static void processObserved(expander_t* ctx, stack_t* es, void (*process)(expander_t*, stack_t*)) {
+    call_stats_t* c = NULL;
+    if (ctx->stats) {
+        c = statsFind(ctx->stats, &ctx->macro_name, ctx->macro_hash, ctx->builtin);
+        statsBegin(ctx->stats, c);
+    }
+    stack_entry_t* entry = top(es);
+    bool traced = ctx->trace && traceBegin(ctx->trace, ctx, es->depth);
+    long long start = c ? monotonicClock() : 0;
+    process(ctx, es);
+
+    if (c) {
+        c->calls++;
+        c->nanoseconds += monotonicClock() - start;
+        if (ctx->builtin != builtin_expandafter) {
+            c->bytes += ctx->expansion->size + (top(es) != entry ? top(es)->size : 0);
+        }
+    }
+
+    /* The depth of the entry holding the expansion, or 0 if there is none */
+    size_t depth = top(es) != entry ? es->depth : ctx->expansion->size > 0 ? es->depth + 1 : 0;
+    if (c) {
+        if (depth > 0) {
+            statsOpen(ctx->stats, depth);
+        } else {
+            statsEnd(ctx->stats);
+        }
+    }
+    if (traced) {
+        if (depth > 0) {
+            traceOpen(ctx->trace, depth);
+        } else {
+            traceEnd(ctx->trace);
+        }
+    }
+}
+
+/* Start expanding the AFTER argument of an \expandafter whose call was just
+read, in a frame of its own on the same stack, with a fresh parser; output
+goes to the frame until its text runs out */
+static void enterFrame(expander_t* ctx, stack_t* es) {
+    if (ctx->frame_count >= ctx->frame_capacity) {
+        ctx->frame_capacity = ctx->frame_capacity ? 2 * ctx->frame_capacity : 8;
+        ctx->frames = realloc(ctx->frames, ctx->frame_capacity * sizeof(frame_t));
+    }
+    frame_t* frame = &ctx->frames[ctx->frame_count++];
+    frame->parser = ctx->parser;
+    frame->before = takeString(es);
+    appendString(frame->before, &ctx->arg1);
+    frame->output.buffer = takeString(es);
+    frame->output.limit = SINK_BLOCK;
+    frame->output.write = NULL;
+    frame->output.ctx = NULL;
+
+    string_t* after = takeString(es);
+    appendString(after, &ctx->arg2);
+    pushOwned(es, after);
+    frame->base = top(es);
+    initParser(&ctx->parser);
+}
+
+/* Finish the innermost \expandafter once its AFTER argument has run out,
+resuming the parser where the call left off with BEFORE followed by the
+expanded AFTER as the expansion of the call */
+static void leaveFrame(expander_t* ctx, stack_t* es, state_t state) {
+    if (!validEnd(state)) {
+        DIE("%s", "invalid end");
+    }
+    frame_t* frame = &ctx->frames[--ctx->frame_count];
+    popEntry(ctx, es);
+    ctx->parser = frame->parser;
+
+    appendString(ctx->expansion, frame->before);
+    appendString(ctx->expansion, frame->output.buffer);
+    keepString(es, frame->before);
+    keepString(es, frame->output.buffer);
+    if (ctx->stats) {
+        ctx->stats->builtins[builtin_expandafter].bytes += ctx->expansion->size;
+    }
+    if(ctx->expansion->size > 0) {
+        pushOwned(es, ctx->expansion);
+        ctx->expansion = takeString(es);
+    }
+}
+
+/* Main driver function, which runs the state machine over the expansion stack
+ES until it is empty, writing output to SINK, or to the innermost unfinished
+\expandafter if there is one */
+static state_t run(expander_t* ctx, stack_t* es, sink_t* sink) {
+    sink_t* output = sink;
+
+    /* Initialize stack entry pointer */
+    stack_entry_t* entry;
+
+    /* Start from the state the parser was left in */
+    state_t state = ctx->parser.state;
+
+    /* Pop stack until empty */
+    LOOP:while((entry = top(es)) != NULL) {
+        output = ctx->frame_count > 0 ? &ctx->frames[ctx->frame_count - 1].output : sink;
+
+        /* Loop through each character of stack entry and tick state machine */
+        for(; entry->place < entry->size; entry->place++) {
+            /* Plain text stays plain text up to the next '\\' or '%', and a
+            comment stays a comment up to the next newline or '%', so copy or
+            skip such runs whole without ticking the state machine */
+            if(state == state_plaintext || state == state_comment) {
+                const char* run = entry->data + entry->place;
+                size_t n = scanUntil(run, entry->size - entry->place, state == state_plaintext ? '\\' : '\n', '%');
+                if(state == state_plaintext) {
+                    sinkBytes(output, run, n);
+                }
+                entry->place += n;
+                if(entry->place == entry->size) {
+                    break;
+                }
+            }
+
+            char c = entry->data[entry->place];
+            state = tick(&ctx->parser, c, ctx->arg_count);
+            // print_state(state, c);
+            
+            /* Based on state, add character to output or character buffer until
+            enough characters are read to process macro */
+            switch(state){
+                case state_plaintext:
+                    sinkChar(output, c);
+                    break;
+                case state_not_alpha_or_escape:
+                    sinkChar(output, '\\');
+                    sinkChar(output, c);
+                    break;
+                case state_macro:
+                    addChar(&ctx->macro_name, c);
+                    ctx->macro_hash = HASH_STEP(ctx->macro_hash, c);
+                    break;
+                case state_argument1:
+                case state_argument1_escape:
+                    addChar(&ctx->arg1, c);
+                    break;
+                case state_argument2:
+                case state_argument2_escape:
+                    addChar(&ctx->arg2, c);
+                    break;
+                case state_argument3:
+                case state_argument3_escape:
+                    addChar(&ctx->arg3, c);
+                    break;
+                case state_argument1_begin:
+                    ctx->builtin = findBuiltin(&ctx->macro_name);
+                    ctx->arg_count = findArgCount(ctx->builtin);
+                    break;
+                case state_argument2_begin:
+                case state_argument3_begin:
+                case state_argument1_end:
+                case state_argument2_end:
+                case state_comment:
+                case state_after_comment:
+                case state_escape:
+                    break;
+                case state_macro_end:
+                    /* Reset argument counter */
+                    ctx->arg_count = 0;
+
+                    /* A call ending its entry needs nothing more from it, so pop
+                    the entry before its expansion goes on, keeping tail-recursive
+                    macros at a constant stack depth */
+                    bool tail = entry->place + 1 == entry->size && entry->source == NULL
+                        && (ctx->frame_count == 0 || entry != ctx->frames[ctx->frame_count - 1].base);
+                    if (tail) {
+                        popEntry(ctx, es);
+                    }
+
+                    /* Handle "expandafter" macro separately, expanding AFTER argument
+                    on the same stack before its expansion is complete */
+                    if (ctx->builtin == builtin_expandafter) {
+                        if(!tail) {
+                            entry->place++;
+                        }
+                        if (ctx->stats || ctx->trace) {
+                            processObserved(ctx, es, enterFrame);
+                        } else {
+                            enterFrame(ctx, es);
+                        }
+                        state = ctx->parser.state;
+                        clearString(&ctx->macro_name);
+                        ctx->macro_hash = HASH_INIT;
+                        clearString(&ctx->arg1);
+                        clearString(&ctx->arg2);
+                        clearString(&ctx->arg3);
+                        goto LOOP;
+                    } else if (ctx->stats || ctx->trace) {
+                        processObserved(ctx, es, processMacro);
+                    } else {
+                        /* Call general macro processing funcion */
+                        processMacro(ctx, es);
+                    }
+
+                    /* Reset buffer strings */
+                    clearString(&ctx->macro_name);
+                    ctx->macro_hash = HASH_INIT;
+                    clearString(&ctx->arg1);
+                    clearString(&ctx->arg2);
+                    clearString(&ctx->arg3);
+
+                    /* Hand new expansion over to the stack if necessary and break
+                    out of both loops to immediately expand top of stack */
+                    if(ctx->expansion->size > 0) {
+                        pushOwned(es, ctx->expansion);
+                        ctx->expansion = takeString(es);
+                    }
+                    if(tail) {
+                        goto LOOP;
+                    }
+                    if(top(es) != entry) {
+                        entry->place++;
+                        goto LOOP;
+                    }
+
+                    break;
+            }            
+        }
+        
+        /* Pop expansion stack when finished top stack entry, unless it
+        streams input and another chunk is available; once the text of an
+        \expandafter runs out, its expansion is complete */
+        if(ctx->frame_count > 0 && entry == ctx->frames[ctx->frame_count - 1].base) {
+            leaveFrame(ctx, es, state);
+            state = ctx->parser.state;
+        } else if(!refill(entry)) {
+            popEntry(ctx, es);
+        }
+    }
+
+    return state;
+}
+
+/* Destroy the stack of an expansion that has run, counting how deep it went
+and what the expansion added to the counters since they read BEFORE if calls
+are counted */
+static void finishStack(expander_t* ctx, const counters_t* before) {
+    if (ctx->stats) {
+        statsStack(ctx->stats, ctx->stack);
+    }
+    destroyStack(ctx->stack);
+    ctx->stack = NULL;
+    if (ctx->stats) {
+        statsCounters(ctx->stats, before);
+    }
+}
+
+/* Expand an in-memory text string */
+state_t expand(expander_t* ctx, string_t* text, sink_t* output) {
+    counters_t before = counters;
+    stack_t* es = ctx->stack = createStack();
+
+    /* Push entire text input onto stack without copying it */
+    pushBorrowed(es, text->data, text->size);
+    state_t state = run(ctx, es, output);
+
+    finishStack(ctx, &before);
+    return state;
+}
+
+/* Expand input streamed from a source one chunk at a time, so macros and
+arguments may straddle chunk boundaries */
+state_t expandSource(expander_t* ctx, source_t* input, sink_t* output) {
+    counters_t before = counters;
+    stack_t* es = ctx->stack = createStack();
+
+    pushSource(es, input);
+    state_t state = run(ctx, es, output);
+
+    finishStack(ctx, &before);
+    return state;
+}
+
+/* Wrap a frozen macro list, taken over by the preamble, as a preamble that
+produces no output of its own */
+preamble_t* createPreamble(macro_list_t* macros) {
+    preamble_t* preamble = malloc(sizeof(preamble_t));
+    preamble->macros = macros;
+    preamble->output = createString();
+    return preamble;
+}
+
+/* Expand a preamble file once on top of BASE (taken over by the preamble) if
+it is not NULL, keeping its macros in a frozen table that expanders on any
+thread can share, and its output to start each document. If the preamble
+fails, what it built is freed before the failure is passed on, leaving BASE
+to the caller */
+preamble_t* loadPreamble(char* file, macro_list_t* base) {
+    expander_t* ctx = createExpander(base);
+    source_t* input = createSource(&file, 1);
+    sink_t* output = createSink(NULL, NULL);
+    trap_t here;
+    trap_t* outer = trap;
+
+    trap = &here;
+    if (setjmp(here.env) != 0) {
+        trap = outer;
+        destroyExpander(ctx);
+        destroySource(input);
+        destroySink(output);
+        DIE("%s", here.message);
+    }
+    if (!validEnd(expandSource(ctx, input, output))) {
+        DIE("%s", "invalid end");
+    }
+    trap = outer;
+    preamble_t* preamble = createPreamble(ctx->macros);
+    appendString(preamble->output, output->buffer);
+    freezeMacroList(preamble->macros);
+
+    ctx->owns_macros = false;
+    destroyExpander(ctx);
+    destroySource(input);
+    destroySink(output);
+    return preamble;
+}
+
+/* Destroy a preamble once no expander uses it any more */
+void destroyPreamble(preamble_t* preamble) {
+    while (preamble->macros) {
+        macro_list_t* base = preamble->macros->base;
+        destroyMacroList(preamble->macros);
+        preamble->macros = base;
+    }
+    destroyString(preamble->output);
+    free(preamble);
+}
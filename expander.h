@@ -0,0 +1,73 @@
+/* ----------------------------------------------------------------------------
+Expander Context
+---------------------------------------------------------------------------- */
+
+/* Builtin macros, told apart from user macros once a call's name is read */
+typedef enum {
+    builtin_none,
+    builtin_def,
+    builtin_undef,
+    builtin_if,
+    builtin_ifdef,
+    builtin_include,
+    builtin_expandafter
+} builtin_t;
+
+/* Where an \expandafter left off while its AFTER argument, the text of the
+stack entry BASE, is expanded: the parser state to resume, its BEFORE argument,
+and the output of AFTER so far */
+typedef struct {
+    parser_t parser;
+    stack_entry_t* base;
+    string_t* before;
+    sink_t output;
+} frame_t;
+
+/* Everything one expansion needs, so independent expansions can run side by
+side: parser state, macro table and the buffers a macro call is read into */
+typedef struct {
+    parser_t parser;
+    macro_list_t* macros;
+    bool owns_macros;
+    string_t macro_name;    /* held in place, as calls are mostly short */
+    size_t macro_hash;      /* of MACRO_NAME, kept up as it is read */
+    builtin_t builtin;      /* what MACRO_NAME names, once its argument opens */
+    string_t arg1;
+    string_t arg2;
+    string_t arg3;
+    string_t* expansion;    /* handed over to the stack once complete */
+    int arg_count;
+    stack_t* stack;         /* expansion stack while an expansion runs */
+    frame_t* frames;        /* innermost \expandafter last */
+    size_t frame_count;
+    size_t frame_capacity;
+    struct stats* stats;    /* calls counted so far, if they are counted */
+    struct trace* trace;    /* calls recorded so far, if they are traced */
+} expander_t;
+
+expander_t* createExpander(macro_list_t* base);
+
+expander_t* createExpanderFor(macro_list_t* ml);
+
+void destroyExpander(expander_t* ctx);
+
+void resetExpander(expander_t* ctx);
+
+bool validEnd(state_t state);
+
+state_t expand(expander_t* ctx, string_t* text, sink_t* output);
+
+state_t expandSource(expander_t* ctx, source_t* input, sink_t* output);
+
+/* Macros defined once up front and shared read-only by many documents, with
+the output the preamble itself produced */
+typedef struct preamble {
+    macro_list_t* macros;
+    string_t* output;
+} preamble_t;
+
+preamble_t* createPreamble(macro_list_t* macros);
+
+preamble_t* loadPreamble(char* file, macro_list_t* base);
+
+void destroyPreamble(preamble_t* preamble);
@@ -0,0 +1,22 @@
+#include <stdarg.h>
+#include "proj1.h"
+
+/* Trap set by the current thread, if any */
+_Thread_local trap_t *trap = NULL;
+
+/* Report a failure: jump to the thread's trap with the message if one is set,
+otherwise write the message to stderr and exit */
+void fail(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (trap != NULL) {
+        vsnprintf(trap->message, sizeof trap->message, format, args);
+        va_end(args);
+        longjmp(trap->env, 1);
+    }
+    fputs("proj1: ", stderr);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+    exit(EXIT_FAILURE);
+}
@@ -1,62 +1,135 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
 #include "proj1.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#include "macros.h"
 
 #define SIZE 8 // Initial number of items for array
+#define READ_BLOCK 65536 // Bytes requested per read from a file
+#define MAP_MIN (1 << 20) // Bytes from which an included file is mapped
 
 
+/* Allocations, pushes and pops made on this thread */
+_Thread_local counters_t counters;
+
+/* Monotonic time in nanoseconds, to time calls and benchmarks by */
+long long monotonicClock(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
 /* ----------------------------------------------------------------------------
 String Helpers
 ---------------------------------------------------------------------------- */
 
-/* Custom string data type */
-typedef struct mystring {
-	char* data;
-	size_t size;
-	size_t capacity;
-} string_t;
+/* Initializes a string_t in place, e.g. on the stack, keeping its contents
+in its own storage until they outgrow it */
+void initString(string_t* s) {
+	s->data = s->local;
+	s->size = 0;
+	s->capacity = STRING_LOCAL;
+	s->local[0] = '\0';
+}
+
+/* Releases whatever a string_t initialized in place moved to the heap */
+void finishString(string_t* s) {
+	if (s->data != s->local) {
+		free(s->data);
+	}
+}
 
 /* Initializes a string_t */
 string_t* createString() {
 	string_t* s = malloc(sizeof(string_t));
-	s->data = malloc(SIZE * sizeof(char));
-	s->size = 0;
-	s->capacity = SIZE;
+	counters.mallocs++;
+	initString(s);
 	return s;
 }
 
+/* Moves a string_t to a heap buffer of CAPACITY bytes */
+static void growString(string_t* s, size_t capacity) {
+	if (s->data == s->local) {
+		s->data = malloc(capacity * sizeof(char));
+		memcpy(s->data, s->local, STRING_LOCAL);
+		counters.mallocs++;
+	} else {
+		s->data = realloc(s->data, capacity * sizeof(char));
+		counters.reallocs++;
+	}
+	s->capacity = capacity;
+}
+
 /* Adds a character to a string_t and doubles memory if necessary */
 void addChar(string_t* s, char c) {
 	s->data[s->size] = c;
 	s->size++;
 	if (s->size >= s->capacity) {
-		s->data = DOUBLE(s->data, s->capacity);
+		growString(s, 2 * s->capacity);
 	}
 	s->data[s->size] = '\0';
 }
 
+/* Grows a string_t by doubling until it can hold SIZE characters */
+void reserveString(string_t* s, size_t size) {
+	if (size < s->capacity) {
+		return;
+	}
+	if (size > SIZE_MAX / 2) {
+		DIE("%s", "String too large.");
+	}
+	size_t capacity = s->capacity;
+	while (size >= capacity) {
+		capacity *= 2;
+	}
+	growString(s, capacity);
+}
+
+/* Appends SIZE bytes at DATA with a single copy */
+void appendBytes(string_t* s, const char* data, size_t size) {
+	reserveString(s, s->size + size);
+	memcpy(s->data + s->size, data, size);
+	s->size += size;
+	s->data[s->size] = '\0';
+}
+
 /* Appends two strings */
 void appendString(string_t* a, string_t* b) {
-	for(int i = 0; i < b->size; i++) {
-		addChar(a, b->data[i]);
-	}
+	appendBytes(a, b->data, b->size);
+}
+
+/* Reads everything left on a file descriptor and appends it to string */
+void appendFd(string_t* s, int fd) {
+	ssize_t n;
+	do {
+		reserveString(s, s->size + READ_BLOCK);
+		n = read(fd, s->data + s->size, READ_BLOCK);
+		if (n < 0) {
+			DIE("%s", "Cannot read file.");
+		}
+		s->size += n;
+	} while (n > 0);
+	s->data[s->size] = '\0';
 }
 
 /* Reads file and appends to string */
 void appendFile(string_t* s, char* file) {
-	FILE *fp;
-	fp = fopen(file, "r");
-	int fpc;
-	while((fpc = fgetc(fp)) != EOF) {
-		addChar(s, fpc);
+	int fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		DIE("%s", "Cannot open file.");
 	}
-	fclose(fp);
+	appendFd(s, fd);
+	close(fd);
 }
 
 /* Destroy string */
 void destroyString(string_t* s) {
-	free(s->data);
+	finishString(s);
 	free(s);
 }
 
@@ -67,12 +140,10 @@ void printString(string_t* s) {
 	}
 }
 
-/* Clears string data and reset size to 0 */
+/* Empties a string, keeping its buffer and capacity for reuse */
 void clearString(string_t* s) {
-	free(s->data);
 	s->size = 0;
-	s->capacity = SIZE;
-	s->data = malloc(SIZE * sizeof(char));
+	s->data[0] = '\0';
 }
 
 /* Clears string data and reset size to 0 */
@@ -84,158 +155,786 @@ int stringCompare(string_t* a, string_t* b) {
 string_t *copyString(string_t *str) {
 	string_t *tmp = createString();
 	if (tmp) {
-		for(int i = 0; i < str->size; i++) {
-			addChar(tmp, str->data[i]);
-		}
+		appendBytes(tmp, str->data, str->size);
 	}
 	return tmp;
 }
 
 /* ----------------------------------------------------------------------------
-Macro Helpers
+Include Cache Helpers
 ---------------------------------------------------------------------------- */
 
-/* User-defined macro data type */
-typedef struct {
-	string_t* macro_name;
-	string_t* definition;
-} macro_t;
+#define INCLUDE_CACHE_LIMIT (64 << 20) // Bytes of file contents kept at most
+#define INCLUDE_CACHE_SETTLE 1         // Seconds a file must be unchanged to be cached
 
-/* User-defined macro list data type */
-typedef struct {
-	macro_t** data; 
-	size_t size;
-	size_t capacity;
-} macro_list_t;
+/* Contents of a file as they were when it had this identity and times */
+typedef struct cached_file {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	struct timespec ctime;
+	string_t* contents;
+	struct cached_file* prev;
+	struct cached_file* next;
+} cached_file_t;
+
+/* Files included by any thread, most recently used first */
+static struct {
+	cached_file_t* head;
+	cached_file_t* tail;
+	size_t bytes;
+	pthread_mutex_t lock;
+} include_cache = { NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER };
+
+/* Unlinks a cached file from the recency list */
+static void cache_unlink(cached_file_t* f) {
+	if (f->prev) {
+		f->prev->next = f->next;
+	} else {
+		include_cache.head = f->next;
+	}
+	if (f->next) {
+		f->next->prev = f->prev;
+	} else {
+		include_cache.tail = f->prev;
+	}
+}
+
+/* Links a cached file in as the most recently used */
+static void cache_link(cached_file_t* f) {
+	f->prev = NULL;
+	f->next = include_cache.head;
+	if (include_cache.head) {
+		include_cache.head->prev = f;
+	} else {
+		include_cache.tail = f;
+	}
+	include_cache.head = f;
+}
+
+/* Drops a cached file from the cache and frees it */
+static void cache_drop(cached_file_t* f) {
+	cache_unlink(f);
+	include_cache.bytes -= f->contents->size;
+	destroyString(f->contents);
+	free(f);
+}
+
+/* Checks whether two file times are the same to the nanosecond */
+static bool same_time(struct timespec a, struct timespec b) {
+	return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+/* Appends the contents of an included file, reading it only if it is not
+cached as it is now; a file is identified by device and inode, so every path
+to it shares one entry, and is reread once its size or times change. A file
+changed within INCLUDE_CACHE_SETTLE seconds is not cached, as the filesystem
+may keep times too coarsely to tell a rewrite of the same size apart */
+void appendInclude(string_t* s, char* file) {
+	struct stat st;
+	if (stat(file, &st) != 0) {
+		DIE("%s", "Cannot open file.");
+	}
+	if (!S_ISREG(st.st_mode)) {
+		appendFile(s, file);
+		return;
+	}
+
+	pthread_mutex_lock(&include_cache.lock);
+	for (cached_file_t* f = include_cache.head; f; f = f->next) {
+		if (f->dev == st.st_dev && f->ino == st.st_ino) {
+			if (f->size == st.st_size && same_time(f->mtime, st.st_mtim)
+			&& same_time(f->ctime, st.st_ctim)) {
+				cache_unlink(f);
+				cache_link(f);
+				appendString(s, f->contents);
+				pthread_mutex_unlock(&include_cache.lock);
+				return;
+			}
+			cache_drop(f);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&include_cache.lock);
+
+	/* Read the file without holding the cache, then keep it unless it alone
+	would take up the whole cache */
+	string_t* contents = createString();
+	appendFile(contents, file);
+	appendString(s, contents);
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (contents->size > INCLUDE_CACHE_LIMIT || now.tv_sec - st.st_ctim.tv_sec <= INCLUDE_CACHE_SETTLE) {
+		destroyString(contents);
+		return;
+	}
+
+	cached_file_t* f = malloc(sizeof(cached_file_t));
+	f->dev = st.st_dev;
+	f->ino = st.st_ino;
+	f->size = st.st_size;
+	f->mtime = st.st_mtim;
+	f->ctime = st.st_ctim;
+	f->contents = contents;
+
+	pthread_mutex_lock(&include_cache.lock);
+	for (cached_file_t* g = include_cache.head; g; g = g->next) {
+		if (g->dev == f->dev && g->ino == f->ino) {
+			/* Read by another thread in the meantime */
+			cache_drop(g);
+			break;
+		}
+	}
+	cache_link(f);
+	include_cache.bytes += contents->size;
+	while (include_cache.bytes > INCLUDE_CACHE_LIMIT) {
+		cache_drop(include_cache.tail);
+	}
+	pthread_mutex_unlock(&include_cache.lock);
+}
 
-/* Initialize macro list */
+/* ----------------------------------------------------------------------------
+Macro Helpers
+---------------------------------------------------------------------------- */
+
+/* Hashes string data with FNV-1a */
+size_t hashString(string_t* s) {
+	size_t h = HASH_INIT;
+	for(size_t i = 0; i < s->size; i++) {
+		h = HASH_STEP(h, s->data[i]);
+	}
+	return h;
+}
+
+/* Initialize macro list as an empty open-addressing hash table */
 macro_list_t* createMacroList() {
 	macro_list_t* ml = malloc(sizeof(macro_list_t));
-	ml->data = malloc(8 * sizeof(macro_t));
+	ml->data = calloc(SIZE, sizeof(macro_t*));
 	ml->size = 0;
-	ml->capacity = 8;
+	ml->capacity = SIZE;
+	ml->base = NULL;
+	ml->frozen = false;
+	ml->offsets = NULL;
+	ml->map = NULL;
+	ml->map_size = 0;
+	return ml;
+}
+
+/* Initialize an empty overlay recording definitions made on top of BASE,
+which must be frozen and outlive the overlay */
+macro_list_t* createOverlay(macro_list_t* base) {
+	macro_list_t* ml = createMacroList();
+	ml->base = base;
 	return ml;
 }
 
+/* Make a macro list immutable so overlays on any number of threads may share
+it; its macros are pinned and no longer reference counted */
+void freezeMacroList(macro_list_t* ml) {
+	for(size_t i = 0; ml->data && i < ml->capacity; i++) {
+		if(ml->data[i]) {
+			ml->data[i]->refs = 0;
+		}
+	}
+	ml->frozen = true;
+}
+
+/* Name of a macro, followed by a NUL */
+char* macroName(macro_t* m) {
+	return (char*) (m->segments + m->segment_count);
+}
+
+/* Definition of a macro, followed by a NUL */
+char* macroDefinition(macro_t* m) {
+	return macroName(m) + m->name_size + 1;
+}
+
 /* Destroy macro */
 void destroyMacro(macro_t* m) {
-	destroyString(m->macro_name);
-	destroyString(m->definition);
 	free(m);
 }
 
-/* Destroy macro list */
+/* Allocates a macro for NAME as one block, splitting DEF at each unescaped
+'#' into the literal runs that are copied around the argument when the macro
+is expanded; with no DEF the entry hides a macro of the base instead */
+static macro_t* macro_create(string_t* name, size_t hash, string_t* def) {
+	size_t segment_count = 0;
+	bool escape = false;
+	for(size_t j = 0; def && j <= def->size; j++) {
+		if(j == def->size || (def->data[j] == '#' && !escape)) {
+			segment_count++;
+			escape = false;
+		} else {
+			escape = !escape && def->data[j] == '\\';
+		}
+	}
+
+	size_t definition_size = def ? def->size : 0;
+	size_t size = sizeof(macro_t) + segment_count * sizeof(segment_t)
+		+ name->size + definition_size + 2;
+	size = (size + 7) & ~(size_t) 7;
+	macro_t* m = calloc(1, size);
+	m->hash = hash;
+	m->refs = 1;
+	m->name_size = name->size;
+	m->definition_size = definition_size;
+	m->segment_count = segment_count;
+	m->size = size;
+	memcpy(macroName(m), name->data, name->size);
+	if(def) {
+		memcpy(macroDefinition(m), def->data, def->size);
+	}
+
+	size_t run = 0;
+	size_t k = 0;
+	for(size_t j = 0; def && j <= def->size; j++) {
+		if(j == def->size || (def->data[j] == '#' && !escape)) {
+			m->segments[k].offset = run;
+			m->segments[k].size = j - run;
+			k++;
+			run = j + 1;
+			escape = false;
+		} else {
+			escape = !escape && def->data[j] == '\\';
+		}
+	}
+	return m;
+}
+
+/* Drop one reference to a macro, destroying it once nothing refers to it;
+pinned macros belong to their frozen list */
+void releaseMacro(macro_t* m) {
+	if(m->refs != 0 && --m->refs == 0) {
+		destroyMacro(m);
+	}
+}
+
+/* Destroy macro list; a frozen list must outlive every overlay on it */
 void destroyMacroList(macro_list_t* ml) {
-	for(int i = 0; i < ml->size; i++) {
-		destroyMacro(ml->data[i]);
+	if(ml->map) {
+		munmap(ml->map, ml->map_size);
+		free(ml);
+		return;
+	}
+	for(size_t i = 0; i < ml->capacity; i++) {
+		if(ml->data[i] && ml->frozen) {
+			destroyMacro(ml->data[i]);
+		} else if(ml->data[i]) {
+			releaseMacro(ml->data[i]);
+		}
 	}
 	free(ml->data);
 	free(ml);
 }
 
-/* Locates whether macro is defined or not */
-int macro_locate(macro_list_t* macro_list, string_t* name) {
-	for(int i = 0; i < macro_list->size; i++) {
-		if(!strcmp(name->data, macro_list->data[i]->macro_name->data)) {
-			return i;
+/* Macro in slot I, whether the list is in memory or mapped from a snapshot */
+static macro_t* macro_at(macro_list_t* macro_list, size_t i) {
+	if(macro_list->data) {
+		return macro_list->data[i];
+	}
+	return macro_list->offsets[i] ? (macro_t*) (macro_list->map + macro_list->offsets[i]) : NULL;
+}
+
+/* Finds the slot holding NAME, or the empty slot where it would be inserted */
+static size_t macro_slot(macro_list_t* macro_list, const char* name, size_t size, size_t hash) {
+	size_t mask = macro_list->capacity - 1;
+	size_t i = hash & mask;
+	macro_t* m;
+	while((m = macro_at(macro_list, i)) != NULL) {
+		if(m->hash == hash && m->name_size == size
+		&& !memcmp(macroName(m), name, size)) {
+			break;
+		}
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+/* Doubles the hash table and reinserts every macro */
+static void macro_rehash(macro_list_t* macro_list) {
+	macro_t** old = macro_list->data;
+	size_t old_capacity = macro_list->capacity;
+
+	macro_list->capacity *= 2;
+	macro_list->data = calloc(macro_list->capacity, sizeof(macro_t*));
+	size_t mask = macro_list->capacity - 1;
+	for(size_t i = 0; i < old_capacity; i++) {
+		if(old[i]) {
+			size_t j = old[i]->hash & mask;
+			while(macro_list->data[j]) {
+				j = (j + 1) & mask;
+			}
+			macro_list->data[j] = old[i];
+		}
+	}
+	free(old);
+}
+
+/* Finds the macro NAME is defined as, checking an overlay before its base;
+an overlay entry without a definition hides the macro underneath */
+static macro_t* macro_find(macro_list_t* macro_list, const char* name, size_t size, size_t hash) {
+	for(; macro_list; macro_list = macro_list->base) {
+		macro_t* m = macro_at(macro_list, macro_slot(macro_list, name, size, hash));
+		if(m) {
+			return m->segment_count ? m : NULL;
 		}
 	}
-	return -1;
+	return NULL;
+}
+
+/* Locates the macro NAME is defined as, or NULL if it is not defined */
+macro_t* macro_locate(macro_list_t* macro_list, string_t* name) {
+	return macro_find(macro_list, name->data, name->size, hashString(name));
+}
+
+/* Locates NAME as macro_locate does, given HASH as hashString would give it */
+macro_t* macro_lookup(macro_list_t* macro_list, string_t* name, size_t hash) {
+	return macro_find(macro_list, name->data, name->size, hash);
 }
 
 /* Defines macro to macro list */
 void macro_def(macro_list_t* macro_list, string_t* name, string_t* def) {
+	size_t hash = hashString(name);
+
 	/* Throw error if already defined */
-	if(macro_locate(macro_list, name) != -1) {
+	if(macro_find(macro_list, name->data, name->size, hash)) {
 		DIE("%s", "Cannot redefine macro.");
 	}
 
-	string_t *macro_name = copyString(name);
-	string_t *definition = copyString(def);
-	macro_t *m = malloc(sizeof(macro_t));
-	m->macro_name = macro_name;
-	m->definition = definition;
-	macro_list->data[macro_list->size] = m;
-	
+	/* Take the place of an entry hiding a base macro, or fill an empty slot */
+	size_t i = macro_slot(macro_list, name->data, name->size, hash);
+	if(macro_list->data[i]) {
+		releaseMacro(macro_list->data[i]);
+		macro_list->data[i] = macro_create(name, hash, def);
+		return;
+	}
+	macro_list->data[i] = macro_create(name, hash, def);
+
+	/* Keep load factor at or below one half so probe chains stay short */
 	macro_list->size++;
-	if (macro_list->size >= macro_list->capacity) {
-		macro_list->data = DOUBLE(macro_list->data, macro_list->capacity);
+	if (2 * macro_list->size > macro_list->capacity) {
+		macro_rehash(macro_list);
 	}
 }
 
 /* Undefine macro to macro list */
 void macro_undef(macro_list_t* macro_list, string_t* name) {
+	size_t hash = hashString(name);
+	size_t i = macro_slot(macro_list, name->data, name->size, hash);
+	bool in_base = macro_list->base && macro_find(macro_list->base, name->data, name->size, hash);
+
 	/* Throw error if cannot find macro */
-	int i = macro_locate(macro_list, name);
-	if(i == -1) {
+	if(!macro_find(macro_list, name->data, name->size, hash)) {
 		DIE("%s", "Macro not defined.");
 	}
-	destroyMacro(macro_list->data[i]);
 
-	/* Shift indices of all macros after undefined macro */
-	for (int j = i; j < macro_list->size - 1; j++) {
-		macro_list->data[j] = macro_list->data[j+1];
+	/* A macro of the base is hidden by an entry without a definition */
+	if(in_base) {
+		if(macro_list->data[i]) {
+			releaseMacro(macro_list->data[i]);
+			macro_list->data[i] = macro_create(name, hash, NULL);
+			return;
+		}
+		macro_list->data[i] = macro_create(name, hash, NULL);
+		macro_list->size++;
+		if (2 * macro_list->size > macro_list->capacity) {
+			macro_rehash(macro_list);
+		}
+		return;
 	}
+	releaseMacro(macro_list->data[i]);
+	macro_list->data[i] = NULL;
 	macro_list->size--;
+
+	/* Shift back later members of the probe chain into the freed slot */
+	size_t mask = macro_list->capacity - 1;
+	size_t hole = i;
+	for(size_t j = (hole + 1) & mask; macro_list->data[j]; j = (j + 1) & mask) {
+		size_t home = macro_list->data[j]->hash & mask;
+		if(((j - home) & mask) >= ((j - hole) & mask)) {
+			macro_list->data[hole] = macro_list->data[j];
+			macro_list->data[j] = NULL;
+			hole = j;
+		}
+	}
 	return;
 }
 
-/* Expand user-defined macro with arguments */
-void macro_expand(macro_list_t* macro_list, string_t* name, string_t* arg1, string_t* expansion) {
-	/* escape boolean for handeling '\#' */
-	static bool escape = false;
+/* Expand user-defined macro with arguments into EXPANSION. A definition without
+'#' is not copied; the macro is returned instead so the caller can push it */
+macro_t* macro_expand(macro_list_t* macro_list, string_t* name, size_t hash, string_t* arg1, string_t* expansion) {
 	/* Throw error if cannot find macro */
-	int i = macro_locate(macro_list, name);
-	if(i == -1) {
+	macro_t* m = macro_lookup(macro_list, name, hash);
+	if(m == NULL) {
 		DIE("%s", "Macro not defined.");
 	}
 
-	/* Add definition to expansion buffer character by character and injecting user argument */
-	for(int j = 0; j < macro_list->data[i]->definition->size; j++) {
-		if(macro_list->data[i]->definition->data[j] == '#' && !escape) {
+	if(m->segment_count == 1) {
+		return m;
+	}
+
+	/* Copy the precompiled literal runs, injecting user argument between them */
+	size_t params = m->segment_count - 1;
+	char* definition = macroDefinition(m);
+	reserveString(expansion, expansion->size + m->definition_size - params + params * arg1->size);
+	for(size_t j = 0; j < m->segment_count; j++) {
+		if(j > 0) {
 			appendString(expansion, arg1);
-		} else {
-			if(!escape && macro_list->data[i]->definition->data[j] == '\\') {
-				escape = true;
-			} else {
-				escape = false;
-			}
-			addChar(expansion, macro_list->data[i]->definition->data[j]);
 		}
+		appendBytes(expansion, definition + m->segments[j].offset, m->segments[j].size);
 	}
-	return;
+	return NULL;
 }
 
 /* ----------------------------------------------------------------------------
-Stack Helpers
+Macro Snapshot Helpers
 ---------------------------------------------------------------------------- */
 
-/* String stack entry data type */
-typedef struct stack_entry {
-	string_t *string;
-	struct stack_entry *next;
-	size_t place;
-} stack_entry_t;
+#define SNAPSHOT_MAGIC "TEXMACRO"
+#define SNAPSHOT_CHECK ((size_t) 0x0102030405060708)
 
-/* String stack data type */
+/* A snapshot is this header, CAPACITY slots holding the offset of a macro
+from the start of the file (0 if empty), then the macros themselves; it is
+only read back on a machine with the same byte order and word size */
 typedef struct {
-	stack_entry_t *head;
-} stack_t;
+	char magic[8];
+	size_t check;
+	size_t count;
+	size_t capacity;
+} snapshot_t;
+
+/* Checks that a mapped macro with ROOM bytes left in the file is pinned and
+that everything it describes lies within it */
+static bool snapshot_valid(macro_t* m, size_t room) {
+	if(m->size < sizeof(macro_t) || m->size > room || m->refs != 0
+	|| m->segment_count == 0
+	|| m->segment_count > (m->size - sizeof(macro_t)) / sizeof(segment_t)
+	|| m->name_size >= m->size || m->definition_size >= m->size
+	|| m->name_size + m->definition_size + 2
+		> m->size - sizeof(macro_t) - m->segment_count * sizeof(segment_t)) {
+		return false;
+	}
+	for(size_t j = 0; j < m->segment_count; j++) {
+		if(m->segments[j].offset > m->definition_size
+		|| m->segments[j].size > m->definition_size - m->segments[j].offset) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Write every macro visible through MACRO_LIST, including those of its
+bases, to FILE as a snapshot that loadMacros can map back in */
+void dumpMacros(macro_list_t* macro_list, char* file) {
+	/* Collect the macros not hidden by an overlay above them */
+	size_t count = 0;
+	for(macro_list_t* ml = macro_list; ml; ml = ml->base) {
+		count += ml->size;
+	}
+	macro_t** visible = malloc((count ? count : 1) * sizeof(macro_t*));
+	count = 0;
+	for(macro_list_t* ml = macro_list; ml; ml = ml->base) {
+		for(size_t i = 0; i < ml->capacity; i++) {
+			macro_t* m = macro_at(ml, i);
+			if(m && macro_find(macro_list, macroName(m), m->name_size, m->hash) == m) {
+				visible[count++] = m;
+			}
+		}
+	}
+
+	/* Lay the slots out as the table will be probed once mapped */
+	snapshot_t header = { SNAPSHOT_MAGIC, SNAPSHOT_CHECK, count, SIZE };
+	while(header.capacity < 2 * count) {
+		header.capacity *= 2;
+	}
+	size_t* offsets = calloc(header.capacity, sizeof(size_t));
+	size_t offset = sizeof(snapshot_t) + header.capacity * sizeof(size_t);
+	for(size_t i = 0; i < count; i++) {
+		size_t j = visible[i]->hash & (header.capacity - 1);
+		while(offsets[j]) {
+			j = (j + 1) & (header.capacity - 1);
+		}
+		offsets[j] = offset;
+		offset += visible[i]->size;
+	}
+
+	FILE* fp = fopen(file, "wb");
+	if(fp == NULL) {
+		DIE("%s", "Cannot open macro snapshot.");
+	}
+	bool ok = fwrite(&header, sizeof(snapshot_t), 1, fp) == 1
+		&& fwrite(offsets, sizeof(size_t), header.capacity, fp) == header.capacity;
+	for(size_t i = 0; ok && i < count; i++) {
+		/* Mapped macros are pinned to their table */
+		macro_t pinned = *visible[i];
+		pinned.refs = 0;
+		ok = fwrite(&pinned, sizeof(macro_t), 1, fp) == 1
+			&& fwrite(visible[i]->segments, visible[i]->size - sizeof(macro_t), 1, fp) == 1;
+	}
+	if(fclose(fp) != 0 || !ok) {
+		DIE("%s", "Cannot write macro snapshot.");
+	}
+	free(offsets);
+	free(visible);
+}
+
+/* Map a snapshot written by dumpMacros as a frozen macro list, using its
+macros in place rather than allocating each of them */
+macro_list_t* loadMacros(char* file) {
+	int fd = open(file, O_RDONLY);
+	struct stat st;
+	if(fd < 0) {
+		DIE("%s", "Cannot open macro snapshot.");
+	}
+	if(fstat(fd, &st) != 0) {
+		close(fd);
+		DIE("%s", "Cannot open macro snapshot.");
+	}
+	size_t map_size = st.st_size;
+	char* map = map_size >= sizeof(snapshot_t)
+		? mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if(map == MAP_FAILED) {
+		DIE("%s", "Invalid macro snapshot.");
+	}
+
+	/* Check the header, that every macro lies within the file, and that the
+	table is at most half full as dumpMacros leaves it, so that a probe for a
+	missing name always reaches an empty slot */
+	snapshot_t* header = (snapshot_t*) map;
+	bool ok = !memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic))
+		&& header->check == SNAPSHOT_CHECK
+		&& header->capacity > 0 && (header->capacity & (header->capacity - 1)) == 0
+		&& header->capacity <= (map_size - sizeof(snapshot_t)) / sizeof(size_t)
+		&& header->count <= header->capacity / 2;
+	const size_t* offsets = (const size_t*) (map + sizeof(snapshot_t));
+	size_t used = 0;
+	for(size_t i = 0; ok && i < header->capacity; i++) {
+		ok = offsets[i] == 0 || (offsets[i] % 8 == 0
+			&& offsets[i] <= map_size - sizeof(macro_t)
+			&& snapshot_valid((macro_t*) (map + offsets[i]), map_size - offsets[i]));
+		used += offsets[i] != 0;
+	}
+	if(!ok || used != header->count) {
+		munmap(map, map_size);
+		DIE("%s", "Invalid macro snapshot.");
+	}
+
+	macro_list_t* ml = malloc(sizeof(macro_list_t));
+	ml->data = NULL;
+	ml->size = header->count;
+	ml->capacity = header->capacity;
+	ml->base = NULL;
+	ml->frozen = true;
+	ml->offsets = offsets;
+	ml->map = map;
+	ml->map_size = map_size;
+	return ml;
+}
+
+/* ----------------------------------------------------------------------------
+Input Source Helpers
+---------------------------------------------------------------------------- */
+
+/* Initialize a source streaming FILES in order, or standard input if COUNT is 0 */
+source_t *createSource(char **files, int count) {
+	source_t *source = malloc(sizeof *source);
+	source->fp = count == 0 ? stdin : NULL;
+	source->files = files;
+	source->count = count;
+	source->next = 0;
+	source->chunk = createString();
+	source->map = NULL;
+	source->map_size = 0;
+	source->data = source->chunk->data;
+	source->size = 0;
+	return source;
+}
+
+/* Maps the whole of a regular, nonempty file read-only for a sequential
+scan; NULL if it is anything else or cannot be mapped */
+static char *mapFile(int fd, size_t *size) {
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+		return NULL;
+	}
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	*size = st.st_size;
+	return map;
+}
+
+/* Read the next block of input, opening the next file when the current one
+is exhausted: all of a file that can be mapped, or else a chunk read into the
+chunk buffer; returns 0 once all input is read */
+size_t readSource(source_t *source) {
+	string_t *chunk = source->chunk;
+	if (source->map) {
+		munmap(source->map, source->map_size);
+		source->map = NULL;
+	}
+	chunk->size = 0;
+	reserveString(chunk, SOURCE_CHUNK);
+	source->data = chunk->data;
+	while (chunk->size == 0) {
+		if (source->fp == NULL) {
+			if (source->next == source->count) {
+				break;
+			}
+			int fd = open(source->files[source->next++], O_RDONLY);
+			if (fd < 0) {
+				DIE("%s", "Cannot open input file.");
+			}
+			if ((source->map = mapFile(fd, &source->map_size)) != NULL) {
+				close(fd);
+				source->data = source->map;
+				return source->size = source->map_size;
+			}
+			source->fp = fdopen(fd, "r");
+		}
+		chunk->size = fread(chunk->data, 1, SOURCE_CHUNK, source->fp);
+		if (chunk->size == 0) {
+			if (source->fp != stdin) {
+				fclose(source->fp);
+			}
+			source->fp = NULL;
+		}
+	}
+	chunk->data[chunk->size] = '\0';
+	return source->size = chunk->size;
+}
+
+/* Destroy a source, closing any file still open */
+void destroySource(source_t *source) {
+	if (source->fp != NULL && source->fp != stdin) {
+		fclose(source->fp);
+	}
+	if (source->map) {
+		munmap(source->map, source->map_size);
+	}
+	destroyString(source->chunk);
+	free(source);
+}
+
+/* ----------------------------------------------------------------------------
+Stack Helpers
+---------------------------------------------------------------------------- */
 
 /* Initialize a stack */
 stack_t *createStack(void) {
 	stack_t *stack = malloc(sizeof *stack);
 	stack->head = NULL;
+	stack->spare = NULL;
+	stack->strings = malloc(SIZE * sizeof(string_t *));
+	stack->string_count = 0;
+	stack->string_capacity = SIZE;
+	stack->depth = 0;
+	stack->max_depth = 0;
 	return stack;
 }
 
-/* Push a string onto the stack */
-void push(stack_t *stack, string_t *string) {
-	stack_entry_t *entry = malloc(sizeof *entry); 
-	entry->string = copyString(string);
+/* Take an empty string from the strings popped so far, or a new one if none
+are spare; it comes back to the stack when an entry owning it is popped */
+string_t *takeString(stack_t *stack) {
+	if (stack->string_count > 0) {
+		return stack->strings[--stack->string_count];
+	}
+	return createString();
+}
+
+/* Give a string taken from the stack back, emptied, for reuse */
+void keepString(stack_t *stack, string_t *string) {
+	clearString(string);
+	if (stack->string_count >= stack->string_capacity) {
+		stack->strings = DOUBLE(stack->strings, stack->string_capacity);
+	}
+	stack->strings[stack->string_count++] = string;
+}
+
+/* Push a new entry scanning SIZE bytes at DATA onto the stack, reusing one
+popped before if any are spare */
+static stack_entry_t *pushEntry(stack_t *stack, const char *data, size_t size) {
+	stack_entry_t *entry = stack->spare;
+	if (entry) {
+		stack->spare = entry->next;
+	} else {
+		entry = malloc(sizeof *entry);
+	}
+	entry->data = data;
+	entry->size = size;
+	entry->string = NULL;
+	entry->macro = NULL;
+	entry->map = NULL;
+	entry->source = NULL;
 	entry->next = stack->head;
 	entry->place = 0;
 	stack->head = entry;
+	if (++stack->depth > stack->max_depth) {
+		stack->max_depth = stack->depth;
+	}
+	counters.pushes++;
+	return entry;
+}
+
+/* Push bytes owned by the caller, which must outlive the entry */
+void pushBorrowed(stack_t *stack, const char *data, size_t size) {
+	pushEntry(stack, data, size);
+}
+
+/* Push a string, taking ownership; it is kept for takeString when the entry
+is popped */
+void pushOwned(stack_t *stack, string_t *string) {
+	pushEntry(stack, string->data, string->size)->string = string;
+}
+
+/* Push a macro definition in place, holding a reference until popped */
+void pushMacro(stack_t *stack, macro_t *m) {
+	pushEntry(stack, macroDefinition(m), m->definition_size)->macro = m;
+	if (m->refs != 0) {
+		m->refs++;
+	}
+}
+
+/* Push an entry reading SOURCE chunk by chunk */
+void pushSource(stack_t *stack, source_t *source) {
+	pushEntry(stack, source->data, 0)->source = source;
+}
+
+/* Push a large regular file mapped whole, to be scanned in place and unmapped
+when popped; false, pushing nothing, if the file is small or cannot be mapped,
+so it is better read */
+bool pushFile(stack_t *stack, char *file) {
+	struct stat st;
+	if (stat(file, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < MAP_MIN) {
+		return false;
+	}
+	int fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	size_t size;
+	char *map = mapFile(fd, &size);
+	close(fd);
+	if (map == NULL) {
+		return false;
+	}
+	pushEntry(stack, map, size)->map = map;
+	return true;
+}
+
+/* Load the next chunk into an exhausted entry; false if there is none */
+bool refill(stack_entry_t *entry) {
+	if (entry->source == NULL || readSource(entry->source) == 0) {
+		return false;
+	}
+	entry->data = entry->source->data;
+	entry->size = entry->source->size;
+	entry->place = 0;
+	return true;
 }
 
 /* Get value of top stack entry */
@@ -248,20 +947,101 @@ stack_entry_t *top(stack_t *theStack) {
 	}
 }
 
-/* Pop off top stack entry from stack */
+/* Pop off top stack entry from stack, keeping it and any string it owned
+for reuse */
 void pop(stack_t *stack) {
 	if (stack->head != NULL) {
 		stack_entry_t *tmp = stack->head;
 		stack->head = stack->head->next;
-		destroyString(tmp->string);
-		free(tmp);
+		if (tmp->string) {
+			keepString(stack, tmp->string);
+		}
+		if (tmp->macro) {
+			releaseMacro(tmp->macro);
+		}
+		if (tmp->map) {
+			munmap(tmp->map, tmp->size);
+		}
+		tmp->next = stack->spare;
+		stack->spare = tmp;
+		stack->depth--;
+		counters.pops++;
 	}
 }
 
-/* Destroy a stack */
+/* Destroy a stack, with every entry and string kept for reuse */
 void destroyStack(stack_t *theStack) {
 	while (theStack->head != NULL) {
 		pop(theStack);
 	}
+	while (theStack->spare != NULL) {
+		stack_entry_t *tmp = theStack->spare;
+		theStack->spare = tmp->next;
+		free(tmp);
+	}
+	for (size_t i = 0; i < theStack->string_count; i++) {
+		destroyString(theStack->strings[i]);
+	}
+	free(theStack->strings);
 	free(theStack);
-}
\ No newline at end of file
+}
+
+/* ----------------------------------------------------------------------------
+Output Sink Helpers
+---------------------------------------------------------------------------- */
+
+/* Writes a block of output to a FILE */
+static void writeFile(void *fp, const char *data, size_t size) {
+	if (fwrite(data, 1, size, fp) != size) {
+		DIE("%s", "Cannot write output.");
+	}
+}
+
+/* Initialize a sink passing blocks of output to WRITE, or keeping all of it
+in its buffer if WRITE is NULL */
+sink_t *createSink(sink_write_t write, void *ctx) {
+	sink_t *sink = malloc(sizeof *sink);
+	sink->buffer = createString();
+	sink->buffer->data[0] = '\0';
+	sink->limit = SINK_BLOCK;
+	sink->write = write;
+	sink->ctx = ctx;
+	return sink;
+}
+
+/* Initialize a sink flushing blocks of output to FP */
+sink_t *createFileSink(FILE *fp) {
+	return createSink(writeFile, fp);
+}
+
+/* Add a character to the sink, flushing the buffer once it is full */
+void sinkChar(sink_t *sink, char c) {
+	addChar(sink->buffer, c);
+	if (sink->buffer->size >= sink->limit && sink->write) {
+		sinkFlush(sink);
+	}
+}
+
+/* Add SIZE bytes at DATA to the sink, flushing the buffer once it is full */
+void sinkBytes(sink_t *sink, const char *data, size_t size) {
+	appendBytes(sink->buffer, data, size);
+	if (sink->buffer->size >= sink->limit && sink->write) {
+		sinkFlush(sink);
+	}
+}
+
+/* Pass everything buffered so far on to the writer */
+void sinkFlush(sink_t *sink) {
+	if (sink->write && sink->buffer->size > 0) {
+		sink->write(sink->ctx, sink->buffer->data, sink->buffer->size);
+		sink->buffer->size = 0;
+		sink->buffer->data[0] = '\0';
+	}
+}
+
+/* Flush and destroy a sink */
+void destroySink(sink_t *sink) {
+	sinkFlush(sink);
+	destroyString(sink->buffer);
+	free(sink);
+}
@@ -1,20 +1,52 @@
 
+/* ----------------------------------------------------------------------------
+Counters
+---------------------------------------------------------------------------- */
+
+/* Allocator calls made by the string helpers, and stack pushes and pops, on
+this thread so far; cheap enough to be counted always */
+typedef struct {
+    size_t mallocs;
+    size_t reallocs;
+    size_t pushes;
+    size_t pops;
+} counters_t;
+
+extern _Thread_local counters_t counters;
+
+long long monotonicClock(void);
+
 /* ----------------------------------------------------------------------------
 String Helpers
 ---------------------------------------------------------------------------- */
 
+#define STRING_LOCAL 40 // Bytes a string holds before moving to the heap
+
+/* DATA points at LOCAL until the contents outgrow it, so a string_t must not
+be copied or moved by value once initialized */
 typedef struct mystring {
     char* data; 
     size_t size;
     size_t capacity;
+    char local[STRING_LOCAL];
 } string_t;
 
+void initString(string_t* s);
+
+void finishString(string_t* s);
+
 string_t* createString();
 
 void addChar(string_t* s, char c);
 
+void reserveString(string_t* s, size_t size);
+
+void appendBytes(string_t* s, const char* data, size_t size);
+
 void appendString(string_t* a, string_t* b);
 
+void appendFd(string_t* s, int fd);
+
 void appendFile(string_t* s, char* file);
 
 void destroyString(string_t* s);
@@ -25,24 +57,70 @@ void clearString(string_t* s);
 
 int stringCompare(string_t* a, string_t* b);
 
+string_t *copyString(string_t *str);
+
+#define HASH_INIT 14695981039346656037ULL // FNV-1a offset basis
+#define HASH_STEP(h, c) (((h) ^ (unsigned char) (c)) * 1099511628211ULL)
+
+size_t hashString(string_t* s);
+
+/* ----------------------------------------------------------------------------
+Include Cache Helpers
+---------------------------------------------------------------------------- */
+
+void appendInclude(string_t* s, char* file);
+
 /* ----------------------------------------------------------------------------
 Macro Helpers
 ---------------------------------------------------------------------------- */
 
+/* Literal run of a definition, copied as is on expansion */
 typedef struct {
-    string_t* macro_name; 
-    string_t* definition;
-} macro_t;
+    size_t offset;
+    size_t size;
+} segment_t;
 
+/* A macro is a single block of SIZE bytes holding no pointers: this header,
+its SEGMENTS, then its name and definition, each followed by a NUL. The
+argument is substituted between each pair of consecutive segments */
 typedef struct {
+    size_t hash;
+    size_t refs;            /* the table and each stack entry reading it; 0 if pinned */
+    size_t name_size;
+    size_t definition_size;
+    size_t segment_count;   /* 0 if the entry hides a macro of the base */
+    size_t size;
+    segment_t segments[];
+} macro_t;
+
+/* Open-addressing hash table; DATA has CAPACITY slots (a power of two). An
+overlay looks names up in itself first, then in its frozen BASE; an entry
+without a definition records that the base macro was undefined. A table
+loaded from a snapshot has no DATA: its slots are OFFSETS of macros in MAP */
+typedef struct macro_list {
 	macro_t** data; 
 	size_t size;
 	size_t capacity;
+	struct macro_list* base;
+	bool frozen;
+	const size_t* offsets;
+	char* map;
+	size_t map_size;
 } macro_list_t;
 
 macro_list_t* createMacroList();
 
-void destroyMacro(macro_t m);
+macro_list_t* createOverlay(macro_list_t* base);
+
+void freezeMacroList(macro_list_t* ml);
+
+char* macroName(macro_t* m);
+
+char* macroDefinition(macro_t* m);
+
+void destroyMacro(macro_t* m);
+
+void releaseMacro(macro_t* m);
 
 void macro_def(macro_list_t* macro_list, string_t* name, string_t* definition);
 
@@ -52,28 +130,95 @@ void destroyMacroList(macro_list_t* ml);
 
 void printMacroList(macro_list_t* ml);
 
-int macro_locate(macro_list_t* macro_list, string_t* name);
+macro_t* macro_locate(macro_list_t* macro_list, string_t* name);
+
+macro_t* macro_lookup(macro_list_t* macro_list, string_t* name, size_t hash);
 
-string_t* macro_expand(macro_list_t* macro_list, string_t* name, string_t* arg1, string_t* expansion);
+macro_t* macro_expand(macro_list_t* macro_list, string_t* name, size_t hash, string_t* arg1, string_t* expansion);
+
+/* ----------------------------------------------------------------------------
+Macro Snapshot Helpers
+---------------------------------------------------------------------------- */
+
+void dumpMacros(macro_list_t* macro_list, char* file);
+
+macro_list_t* loadMacros(char* file);
+
+/* ----------------------------------------------------------------------------
+Input Source Helpers
+---------------------------------------------------------------------------- */
+
+#define SOURCE_CHUNK 65536 // Bytes read from the input at a time
+
+/* Input read from each of FILES in turn, or from FP alone. DATA holds the
+SIZE bytes read last: a regular file is mapped whole as MAP, anything else is
+read through FP in chunks */
+typedef struct {
+  FILE *fp;
+  char **files;
+  int count;
+  int next;
+  string_t *chunk;
+  char *map;
+  size_t map_size;
+  const char *data;
+  size_t size;
+} source_t;
+
+source_t *createSource(char **files, int count);
+
+size_t readSource(source_t *source);
+
+void destroySource(source_t *source);
 
 /* ----------------------------------------------------------------------------
 Stack Helpers
 ---------------------------------------------------------------------------- */
 
 
+/* An entry scans DATA in place; STRING, MACRO or MAP, if set, is what owns
+it. An entry with a SOURCE is refilled from it each time DATA runs out */
 typedef struct stack_entry {
+  const char *data;
+  size_t size;
   string_t *string;
+  macro_t *macro;
+  char *map;
+  source_t *source;
   struct stack_entry *next;
   size_t place;
 } stack_entry_t;
 
+/* Popped entries are kept on SPARE, and the strings they owned in STRINGS,
+to be reused by later pushes until the stack is destroyed. DEPTH counts the
+entries on the stack, MAX_DEPTH the most there have been at once */
 typedef struct {
   stack_entry_t *head;
+  stack_entry_t *spare;
+  string_t **strings;
+  size_t string_count;
+  size_t string_capacity;
+  size_t depth;
+  size_t max_depth;
 } stack_t;
 
 stack_t *createStack(void);
 
-void push(stack_t *stack, string_t *string);
+string_t *takeString(stack_t *stack);
+
+void keepString(stack_t *stack, string_t *string);
+
+void pushBorrowed(stack_t *stack, const char *data, size_t size);
+
+void pushOwned(stack_t *stack, string_t *string);
+
+void pushMacro(stack_t *stack, macro_t *m);
+
+void pushSource(stack_t *stack, source_t *source);
+
+bool pushFile(stack_t *stack, char *file);
+
+bool refill(stack_entry_t *entry);
 
 stack_entry_t *top(stack_t *stack);
 
@@ -81,4 +226,32 @@ void pop(stack_t *stack);
 
 void clear(stack_t *stack);
 
-void destroyStack(stack_t *stack);
\ No newline at end of file
+void destroyStack(stack_t *stack);
+
+/* ----------------------------------------------------------------------------
+Output Sink Helpers
+---------------------------------------------------------------------------- */
+
+#define SINK_BLOCK 65536 // Bytes buffered before a sink flushes
+
+typedef void (*sink_write_t)(void *ctx, const char *data, size_t size);
+
+/* Output buffer handed to WRITE in blocks of about LIMIT bytes */
+typedef struct {
+  string_t *buffer;
+  size_t limit;
+  sink_write_t write;
+  void *ctx;
+} sink_t;
+
+sink_t *createSink(sink_write_t write, void *ctx);
+
+sink_t *createFileSink(FILE *fp);
+
+void sinkChar(sink_t *sink, char c);
+
+void sinkBytes(sink_t *sink, const char *data, size_t size);
+
+void sinkFlush(sink_t *sink);
+
+void destroySink(sink_t *sink);
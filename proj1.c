@@ -1,211 +1,160 @@
 #include "proj1.h"
 #include "statemachine.h"
 #include "macros.h"
+#include "expander.h"
+#include "texmacro.h"
+#include "batch.h"
+#include "server.h"
 #include <stdbool.h>
 #include <string.h>
-#include <assert.h>
 
-/* Finds the correct number of arguments based on a given macro name */
-int findArgCount(char* macro_name) {
-    if (strcmp(macro_name, "def") == 0 || strcmp(macro_name, "expandafter") == 0) {
-        return 2;
-    }
-    else if (strcmp(macro_name, "if") == 0 || strcmp(macro_name, "ifdef") == 0) {
-        return 3;
-    }
-    else {
-        return 1;
-    }
+#define USAGE "usage: proj1 [--load-macros SNAPSHOT] [--preamble FILE] " \
+    "[--dump-macros SNAPSHOT] [--stats|--stats-json] [--trace TRACE] " \
+    "[-o OUTPUT] [FILE]...\n" \
+    "       proj1 [--load-macros SNAPSHOT] [--preamble FILE] " \
+    "--batch MANIFEST [--jobs N]\n" \
+    "       proj1 [--load-macros SNAPSHOT] [--preamble FILE] --serve SOCKET|-"
+
+/* Writes a block of output to the FILE at CTX */
+static int writeOutput(void* ctx, const char* data, size_t size) {
+    return fwrite(data, 1, size, ctx) == size ? 0 : -1;
 }
 
-/* Macro processing function which reads macro name and arguments and expands
-into an expansion string or performs built in macros */
-string_t *processMacro(string_t* macro_name, string_t* arg1, string_t* arg2,
-                       string_t* arg3, macro_list_t* ml, string_t* expansion) {    
-    if (!strcmp(macro_name->data, "def")) {
-        macro_def(ml, arg1, arg2);
-    } else if (!strcmp(macro_name->data, "undef")) {
-        macro_undef(ml, arg1);
-    } else if (!strcmp(macro_name->data, "if")) {
-        if(arg1->size != 0) {
-            appendString(expansion, arg2);
-        } else {
-            appendString(expansion, arg3);
-        }
-    } else if (!strcmp(macro_name->data, "ifdef")) {
-        if(macro_locate(ml, arg1) != -1) {
-            appendString(expansion, arg2);
+/* Main function responsible for reading input and streaming output */
+int main(int argc, char **argv) {
+    FILE* out = stdout;
+    char* manifest = NULL;
+    char* address = NULL;
+    int jobs = 0;
+    char* preamble_file = NULL;
+    char* load_file = NULL;
+    char* dump_file = NULL;
+    int stats = -1;
+    char* trace_file = NULL;
+    texmacro_base_t* preamble = NULL;
+
+    /* Parse options preceding the input files */
+    int first = 1;
+    while(first < argc && argv[first][0] == '-' && argv[first][1] != '\0') {
+        if(!strcmp(argv[first], "-o") && first + 1 < argc) {
+            if(out != stdout) {
+                fclose(out);
+            }
+            if((out = fopen(argv[first + 1], "w")) == NULL) {
+                DIE("%s", "Cannot open output file.");
+            }
+            first += 2;
+        } else if(!strcmp(argv[first], "--batch") && first + 1 < argc) {
+            manifest = argv[first + 1];
+            first += 2;
+        } else if(!strcmp(argv[first], "--serve") && first + 1 < argc) {
+            address = argv[first + 1];
+            first += 2;
+        } else if(!strcmp(argv[first], "--jobs") && first + 1 < argc) {
+            jobs = atoi(argv[first + 1]);
+            first += 2;
+        } else if(!strcmp(argv[first], "--preamble") && first + 1 < argc) {
+            preamble_file = argv[first + 1];
+            first += 2;
+        } else if(!strcmp(argv[first], "--load-macros") && first + 1 < argc) {
+            load_file = argv[first + 1];
+            first += 2;
+        } else if(!strcmp(argv[first], "--dump-macros") && first + 1 < argc) {
+            dump_file = argv[first + 1];
+            first += 2;
+        } else if(!strcmp(argv[first], "--trace") && first + 1 < argc) {
+            trace_file = argv[first + 1];
+            first += 2;
+        } else if(!strcmp(argv[first], "--stats")) {
+            stats = 0;
+            first++;
+        } else if(!strcmp(argv[first], "--stats-json")) {
+            stats = 1;
+            first++;
         } else {
-            appendString(expansion, arg3);
+            DIE("%s", USAGE);
         }
-    } else if (!strcmp(macro_name->data, "include")) {
-        appendFile(expansion, arg1->data);
-    } else {
-        macro_expand(ml, macro_name, arg1, expansion);
     }
-    return expansion;
-}
-
-/* Main driver function, which establishes state machine and expansion stack,
-converting text string into output string */
-state_t expand(string_t* text, string_t* output, macro_list_t* ml) {
 
-    /* Initialize stack and stack entry pointer */
-    stack_t* es = createStack();
-    stack_entry_t* entry;
-    
-    /* Initialize string buffers */
-    string_t* macro_name = createString();
-    string_t* arg1 = createString();
-    string_t* arg2 = createString();
-    string_t* arg3 = createString();
-    string_t* expansion = createString();
-
-    /* Initialize state and argument count */
-    state_t state = state_plaintext;
-    int arg_count = 0;
-
-    /* Push entire text input onto stack */
-    push(es, text);
-
-    /* Pop stack until empty */
-    LOOP:while((entry = top(es)) != NULL) {
-        /* Loop through each character of stack entry and tick state machine */
-        for(; entry->place < entry->string->size; entry->place++) {
-            char c = entry->string->data[entry->place];
-            state = tick(c, arg_count);
-            // print_state(state, c);
-            
-            /* Based on state, add character to output or character buffer until
-            enough characters are read to process macro */
-            switch(state){
-                case state_plaintext:
-                    addChar(output, c);
-                    break;
-                case state_not_alpha_or_escape:
-                    addChar(output, '\\');
-                    addChar(output, c);
-                    break;
-                case state_macro:
-                    addChar(macro_name, c);
-                    break;
-                case state_argument1:
-                case state_argument1_escape:
-                    addChar(arg1, c);
-                    break;
-                case state_argument2:
-                case state_argument2_escape:
-                    addChar(arg2, c);
-                    break;
-                case state_argument3:
-                case state_argument3_escape:
-                    addChar(arg3, c);
-                    break;
-                case state_argument1_begin:
-                    arg_count = findArgCount(macro_name->data);
-                    break;
-                case state_argument2_begin:
-                case state_argument3_begin:
-                case state_argument1_end:
-                case state_argument2_end:
-                case state_comment:
-                case state_after_comment:
-                case state_escape:
-                    break;
-                case state_macro_end:
-                    /* Reset argument counter */
-                    arg_count = 0;
-
-                    /* Handle "expandafter" macro separately, recursively calling expand
-                    on AFTER argument and concatenating on unexpanded BEFORE argument */
-                    if (!strcmp(macro_name->data, "expandafter")) {
-                        /* Initialize temporary buffer for expanded AFTER argument */
-                        string_t* after_buffer = createString();
-                        
-                        /* Recursive expand call on AFTER argument */
-                        state = expand(arg2, after_buffer, ml);
-
-                        /* Concatenating BEFORE argument and expanded AFTER argument */
-                        appendString(expansion, arg1);
-                        appendString(expansion, after_buffer);
-                        
-                        destroyString(after_buffer);
-                    } else {
-                        /* Call general macro processing funcion */
-                        expansion = processMacro(macro_name, arg1, arg2, arg3, ml, expansion);
-                    }
-
-                    /* Reset buffer strings */
-                    clearString(macro_name);
-                    clearString(arg1);
-                    clearString(arg2);
-                    clearString(arg3);
+    /* Start from the snapshot's macros, then the preamble's on top of them */
+    if(load_file || preamble_file) {
+        if((preamble = texmacroLoadBase(load_file, preamble_file)) == NULL) {
+            DIE("%s", texmacroError());
+        }
+    }
 
-                    /* Push new expansion onto stack if necessary and break out of
-                    both loops to immediately expand top of stack */
-                    if(expansion->size > 0) {
-                        push(es, expansion);
-                        clearString(expansion);
-                        entry->place++;
-                        goto LOOP;
-                    }
+    /* Answer requests until standard input or the process ends */
+    if(address != NULL) {
+        if(first != argc || out != stdout || dump_file != NULL || manifest != NULL || stats >= 0
+        || trace_file != NULL) {
+            DIE("%s", USAGE);
+        }
+        int status = runServer(address, preamble);
+        if(preamble) {
+            texmacroDestroyBase(preamble);
+        }
+        return status;
+    }
 
-                    break;
-            }            
+    /* Expand each document listed in the manifest independently */
+    if(manifest != NULL) {
+        if(first != argc || out != stdout || dump_file != NULL || stats >= 0 || trace_file != NULL) {
+            DIE("%s", USAGE);
+        }
+        int failures = runBatch(manifest, jobs, preamble);
+        if(preamble) {
+            texmacroDestroyBase(preamble);
         }
-        
-        /* Pop expansion stack when finished top stack entry */
-        pop(es);
+        return failures == 0 ? 0 : EXIT_FAILURE;
     }
 
-    /* Destroy string buffers and expansion stack */
-    destroyString(macro_name);
-    destroyString(expansion);
-    destroyString(arg1);
-    destroyString(arg2);
-    destroyString(arg3);
-    destroyStack(es);
+    /* Expand the files in order, or standard input if there are none, with
+    a macro table of its own on top of the preamble's macros if there is one,
+    writing output as it is produced */
+    texmacro_t* tm = texmacroCreate(preamble);
+    if(stats >= 0) {
+        texmacroCollectStats(tm);
+    }
+    if(trace_file != NULL) {
+        texmacroCollectTrace(tm, 0);
+    }
+    if(texmacroExpandFiles(tm, argv + first, argc - first, writeOutput, out) != 0) {
+        DIE("%s", texmacroError());
+    }
 
-    return state;
-}
+    /* Save every macro defined by the end of the document */
+    if(dump_file && texmacroDump(tm, dump_file) != 0) {
+        DIE("%s", texmacroError());
+    }
 
-/* Main function responsible for reading input and printing output */
-int main(int argc, char **argv) {
-    /* Initialize input and output buffers and user-defined macro list */
-    string_t* input = createString();
-    string_t* output = createString();
-    macro_list_t* ml = createMacroList();
+    if(fclose(out) != 0) {
+        DIE("%s", "Cannot write output.");
+    }
 
-    int c;
+    /* Report the macros that took longest to standard error */
+    if(stats >= 0 && texmacroWriteStats(tm, stats, writeOutput, stderr) != 0) {
+        DIE("%s", texmacroError());
+    }
 
-    /* Read from standard input */
-    if(argc == 1) {
-        while((c = getchar()) != EOF) {
-            addChar(input, c);
+    /* Save the trace of every call for a trace viewer */
+    if(trace_file != NULL) {
+        FILE* fp = fopen(trace_file, "w");
+        if(fp == NULL) {
+            DIE("%s", "Cannot open trace file.");
         }
-    /* Read from files */
-    } else if (argc > 1) {
-        for(int i = 1; i < argc; i++) {
-            appendFile(input, argv[i]);
+        if(texmacroWriteTrace(tm, writeOutput, fp) != 0) {
+            DIE("%s", texmacroError());
+        }
+        if(fclose(fp) != 0) {
+            DIE("%s", "Cannot write trace file.");
         }
     }
 
-    /* Call expand functino on entire input */
-    state_t state = expand(input, output, ml);
-
-    /* Check if ending state is valid */
-    if(state != state_plaintext && state != state_comment && state != state_after_comment
-    && state != state_macro_end && state != state_not_alpha_or_escape) {
-        DIE("%s", "invalid end");
+    /* Destroy the context and preamble */
+    texmacroDestroy(tm);
+    if(preamble) {
+        texmacroDestroyBase(preamble);
     }
-    
-    /* Print output buffer */
-    printString(output);
-
-    /* Destroy input and output buffers and user-defined macro list */
-    destroyString(input);
-    destroyString(output);
-    destroyMacroList(ml);
 
     return 0;
-}
\ No newline at end of file
+}
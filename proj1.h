@@ -8,12 +8,24 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <setjmp.h>
 
 // Write message to stderr using format FORMAT
 #define WARN(format,...) fprintf (stderr, "proj1: " format "\n", __VA_ARGS__)
 
-// Write message to stderr using format FORMAT and exit.
-#define DIE(format,...)  WARN(format,__VA_ARGS__), exit (EXIT_FAILURE)
+// Write message to stderr using format FORMAT and exit, unless this thread has
+// set a trap, which then receives the message instead.
+#define DIE(format,...)  fail (format, __VA_ARGS__)
+
+// Where a failure on this thread jumps to, if set, with its message
+typedef struct {
+    jmp_buf env;
+    char message[256];
+} trap_t;
+
+extern _Thread_local trap_t *trap;
+
+_Noreturn void fail (const char *format, ...);
 
 // Double the size of an allocated block PTR with NMEMB members and update
 // NMEMB accordingly.  (NMEMB is only the size in bytes if PTR is a char *.)
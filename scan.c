@@ -0,0 +1,68 @@
+#include <stddef.h>
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+/* Length of the prefix of DATA containing neither A nor B, one byte at a time */
+size_t scanUntilScalar(const char* data, size_t size, char a, char b) {
+    size_t i = 0;
+    while(i < size && data[i] != a && data[i] != b) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef SCAN_X86
+
+/* 32 bytes per step with AVX2 */
+__attribute__((target("avx2")))
+static size_t scanUntilAvx2(const char* data, size_t size, char a, char b) {
+    __m256i va = _mm256_set1_epi8(a);
+    __m256i vb = _mm256_set1_epi8(b);
+    size_t i = 0;
+    for(; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (data + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+        if(mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + scanUntilScalar(data + i, size - i, a, b);
+}
+
+/* 16 bytes per step with SSE2 */
+__attribute__((target("sse2")))
+static size_t scanUntilSse2(const char* data, size_t size, char a, char b) {
+    __m128i va = _mm_set1_epi8(a);
+    __m128i vb = _mm_set1_epi8(b);
+    size_t i = 0;
+    for(; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (data + i));
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(
+            _mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+        if(mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + scanUntilScalar(data + i, size - i, a, b);
+}
+
+#endif
+
+/* Length of the prefix of DATA containing neither A nor B, using the widest
+vector instructions the CPU supports */
+size_t scanUntil(const char* data, size_t size, char a, char b) {
+#ifdef SCAN_X86
+    if(__builtin_cpu_supports("avx2")) {
+        return scanUntilAvx2(data, size, a, b);
+    }
+    if(__builtin_cpu_supports("sse2")) {
+        return scanUntilSse2(data, size, a, b);
+    }
+#endif
+    return scanUntilScalar(data, size, a, b);
+}
@@ -0,0 +1,7 @@
+/* ----------------------------------------------------------------------------
+Run Scanning Helpers
+---------------------------------------------------------------------------- */
+
+size_t scanUntil(const char* data, size_t size, char a, char b);
+
+size_t scanUntilScalar(const char* data, size_t size, char a, char b);
@@ -0,0 +1,262 @@
+#include "proj1.h"
+#include "statemachine.h"
+#include "macros.h"
+#include "expander.h"
+#include "server.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define REQUEST_MAX (256 << 20) // Largest document a request may carry, in bytes
+#define IDLE_TIMEOUT 30         // Seconds a connection may go without reading or writing
+#define ACCEPT_BACKOFF 100      // Milliseconds to wait after accept fails for want of resources
+
+/* State kept warm from one request to the next */
+typedef struct {
+    preamble_t* preamble;
+    string_t* document;
+    sink_t* output;
+} server_t;
+
+/* A connection accepted on the socket, served by a thread of its own */
+typedef struct {
+    preamble_t* preamble;
+    int fd;
+} connection_t;
+
+/* Expand the document of one request into the server's output buffer with
+a macro table of its own, layered over the preamble if there is one; returns
+false and leaves the reason in MESSAGE if it fails */
+static bool serveDocument(server_t* server, char* message, size_t size) {
+    trap_t here;
+    expander_t* ctx = createExpander(server->preamble ? server->preamble->macros : NULL);
+    sink_t* output = server->output;
+    bool ok = true;
+
+    output->buffer->size = 0;
+    trap = &here;
+    if (setjmp(here.env) == 0) {
+        if (server->preamble) {
+            sinkBytes(output, server->preamble->output->data, server->preamble->output->size);
+        }
+        if (!validEnd(expand(ctx, server->document, output))) {
+            DIE("%s", "invalid end");
+        }
+    } else {
+        snprintf(message, size, "%s", here.message);
+        ok = false;
+    }
+    trap = NULL;
+
+    /* Definitions made by this document go with its table */
+    destroyExpander(ctx);
+    return ok;
+}
+
+/* Write SIZE bytes at DATA to FD, without raising SIGPIPE if FD is a socket
+whose client has gone away; returns false if they cannot all be written */
+static bool sendAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == ENOTSOCK) {
+            n = write(fd, data, size);
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+/* Read the length line of a request from IN: digits only, ending in a
+newline (or a carriage return and newline). Returns 1 and sets SIZE, which
+may still exceed REQUEST_MAX; 0 if IN ends first; or -1 if the line is
+malformed or its number does not fit in a size_t */
+static int readLength(FILE* in, size_t* size) {
+    int c = getc(in);
+    if (c == EOF) {
+        return 0;
+    }
+    size_t n = 0;
+    int digits = 0;
+    for (; isdigit(c); c = getc(in), digits++) {
+        if (n > (SIZE_MAX - 9) / 10) {
+            return -1;
+        }
+        n = 10 * n + (c - '0');
+    }
+    if (c == '\r') {
+        c = getc(in);
+    }
+    if (digits == 0 || c != '\n') {
+        return -1;
+    }
+    *size = n;
+    return 1;
+}
+
+/* Skip SIZE bytes of IN; false if it ends first */
+static bool skipBytes(FILE* in, size_t size) {
+    char buffer[4096];
+    while (size > 0) {
+        size_t n = fread(buffer, 1, size < sizeof buffer ? size : sizeof buffer, in);
+        if (n == 0) {
+            return false;
+        }
+        size -= n;
+    }
+    return true;
+}
+
+/* Send a response of STATUS with SIZE bytes at BODY */
+static bool respond(int out, const char* status, const char* body, size_t size) {
+    char header[64];
+    snprintf(header, sizeof header, "%s %zu\n", status, size);
+    return sendAll(out, header, strlen(header)) && sendAll(out, body, size);
+}
+
+/* Answer requests read from IN on OUT until IN ends; each request is its
+length in bytes on a line of its own followed by the document, and each
+response is "ok" or "error" and a length on a line, then the expansion or
+the reason it failed. A document over REQUEST_MAX bytes is skipped with an
+error. Returns false, after an error response if it can, if a request is
+malformed or cut short */
+static bool serveStream(server_t* server, FILE* in, int out) {
+    size_t size;
+    int status;
+    while ((status = readLength(in, &size)) == 1) {
+        if (size > REQUEST_MAX) {
+            const char* reason = "Request too large.";
+            if (!skipBytes(in, size) || !respond(out, "error", reason, strlen(reason))) {
+                return false;
+            }
+            continue;
+        }
+
+        /* Read the document into the buffer kept from the last request */
+        string_t* document = server->document;
+        reserveString(document, size + 1);
+        document->size = fread(document->data, 1, size, in);
+        if (document->size != size) {
+            return false;
+        }
+        document->data[size] = '\0';
+
+        char message[256];
+        bool ok;
+        if (serveDocument(server, message, sizeof message)) {
+            ok = respond(out, "ok", server->output->buffer->data, server->output->buffer->size);
+        } else {
+            ok = respond(out, "error", message, strlen(message));
+        }
+        if (!ok) {
+            return false;
+        }
+    }
+    if (status < 0) {
+        const char* reason = "Malformed request.";
+        respond(out, "error", reason, strlen(reason));
+        return false;
+    }
+    return !ferror(in);
+}
+
+/* Serve the requests of one connection, with buffers of its own, then close
+it; the preamble is frozen, so every connection can share it */
+static void* serveConnection(void* arg) {
+    connection_t* connection = arg;
+    server_t server;
+    server.preamble = connection->preamble;
+    server.document = createString();
+    server.output = createSink(NULL, NULL);
+
+    FILE* in = fdopen(connection->fd, "r");
+    if (in == NULL) {
+        close(connection->fd);
+    } else {
+        if (!serveStream(&server, in, connection->fd)) {
+            WARN("%s", "Malformed request.");
+        }
+        fclose(in);
+    }
+    destroyString(server.document);
+    destroySink(server.output);
+    free(connection);
+    return NULL;
+}
+
+/* Wait out a failed accept if it failed for want of descriptors or memory,
+which only a connection closing frees up, rather than retrying at once */
+static void acceptBackoff(void) {
+    if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+        struct timespec wait = { 0, ACCEPT_BACKOFF * 1000000L };
+        nanosleep(&wait, NULL);
+    }
+}
+
+/* Serve requests on standard input and output if ADDRESS is "-", otherwise
+on a Unix domain socket at ADDRESS, each connection concurrently on a thread
+of its own and dropped once it goes IDLE_TIMEOUT seconds without progress,
+sharing PREAMBLE if it is not NULL; returns only once standard input ends */
+int runServer(char* address, preamble_t* preamble) {
+    if (!strcmp(address, "-")) {
+        server_t server;
+        server.preamble = preamble;
+        server.document = createString();
+        server.output = createSink(NULL, NULL);
+        bool ok = serveStream(&server, stdin, STDOUT_FILENO);
+        destroyString(server.document);
+        destroySink(server.output);
+        if (!ok) {
+            DIE("%s", "Malformed request.");
+        }
+        return 0;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(address) >= sizeof addr.sun_path) {
+        DIE("%s", "Socket path too long.");
+    }
+    strcpy(addr.sun_path, address);
+    unlink(address);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr*) &addr, sizeof addr) != 0
+    || listen(listener, SOMAXCONN) != 0) {
+        DIE("%s", "Cannot listen on socket.");
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    struct timeval timeout = { IDLE_TIMEOUT, 0 };
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            acceptBackoff();
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+
+        connection_t* connection = malloc(sizeof(connection_t));
+        connection->preamble = preamble;
+        connection->fd = fd;
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, serveConnection, connection) != 0) {
+            WARN("%s", "Cannot start connection thread.");
+            close(fd);
+            free(connection);
+        }
+    }
+}
@@ -0,0 +1,5 @@
+/* ----------------------------------------------------------------------------
+Server Mode
+---------------------------------------------------------------------------- */
+
+int runServer(char* address, preamble_t* preamble);
@@ -1,245 +1,191 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
-#include <assert.h>
-#include <ctype.h>
 #include "proj1.h"
+#include "statemachine.h"
 
-typedef enum myenum {
-    state_plaintext,
-    state_escape,
-    state_macro,
-    state_comment,
-    state_after_comment,
-    state_argument1_begin,
-    state_argument1,
-    state_argument1_escape,
-    state_argument1_end,
-    state_argument2_begin,
-    state_argument2,
-    state_argument2_escape,
-    state_argument2_end,
-    state_argument3_begin,
-    state_argument3,
-    state_argument3_escape,
-    state_macro_end,
-    state_not_alpha_or_escape,
-} state_t;
+#define STATE_COUNT (state_not_alpha_or_escape + 1)
+#define ARG_MAX_COUNT 4 // Argument counts 0 (no macro open) through 3
 
-/* Checks whether or not character is defined as escapable */
-bool isescapechar(char c) {
-    return (c == '\\' || c == '#' || c == '%' || c == '{' || c == '}');
-}
+/* Character classes the state machine distinguishes */
+typedef enum {
+    class_other,
+    class_alnum,
+    class_blank,
+    class_newline,
+    class_backslash,
+    class_percent,
+    class_open,
+    class_close,
+    class_hash,
+    class_count,
+} class_t;
 
-/* Balanced parenthases algorithm */
-bool balanced_paren(bool x) {
-    static size_t n = 0;
-    if(x) {
-        n++;
-    } else {
-        n--;
-    }
-    if (n < 0) {
-        DIE("%s", "Invalid parentheses.");
-    } else if (n == 0) {
-        return true;
-    } else {
-        return false;
-    }
-}
+/* Side effects of a transition besides the change of state */
+typedef enum {
+    act_none,
+    act_open,           /* one more unbalanced '{' */
+    act_close,          /* one less; stay put unless braces balance again */
+    act_comment,        /* remember where to resume after the comment */
+    act_resume,         /* comment over; handle character in resumed state */
+    act_bad_macro,
+    act_expect_open,
+} action_t;
 
-/* State machine ticker */
-state_t tick(char c, int arg_max) {
-    static state_t state = state_plaintext;
-    static state_t prev_state = state_plaintext;
+typedef struct {
+    unsigned char next;
+    unsigned char action;
+} transition_t;
 
-    if(c == '%' && state != state_escape) {
-        prev_state = state;
-        state = state_comment;
-    }
+/* Class of every byte; anything not listed is class_other */
+static const unsigned char classes[256] = {
+    ['\\'] = class_backslash, ['%'] = class_percent, ['{'] = class_open,
+    ['}'] = class_close, ['#'] = class_hash, ['\n'] = class_newline,
+    [' '] = class_blank, ['\t'] = class_blank,
+    ['0'] = class_alnum, ['1'] = class_alnum, ['2'] = class_alnum,
+    ['3'] = class_alnum, ['4'] = class_alnum, ['5'] = class_alnum,
+    ['6'] = class_alnum, ['7'] = class_alnum, ['8'] = class_alnum,
+    ['9'] = class_alnum,
+    ['A'] = class_alnum, ['B'] = class_alnum, ['C'] = class_alnum,
+    ['D'] = class_alnum, ['E'] = class_alnum, ['F'] = class_alnum,
+    ['G'] = class_alnum, ['H'] = class_alnum, ['I'] = class_alnum,
+    ['J'] = class_alnum, ['K'] = class_alnum, ['L'] = class_alnum,
+    ['M'] = class_alnum, ['N'] = class_alnum, ['O'] = class_alnum,
+    ['P'] = class_alnum, ['Q'] = class_alnum, ['R'] = class_alnum,
+    ['S'] = class_alnum, ['T'] = class_alnum, ['U'] = class_alnum,
+    ['V'] = class_alnum, ['W'] = class_alnum, ['X'] = class_alnum,
+    ['Y'] = class_alnum, ['Z'] = class_alnum,
+    ['a'] = class_alnum, ['b'] = class_alnum, ['c'] = class_alnum,
+    ['d'] = class_alnum, ['e'] = class_alnum, ['f'] = class_alnum,
+    ['g'] = class_alnum, ['h'] = class_alnum, ['i'] = class_alnum,
+    ['j'] = class_alnum, ['k'] = class_alnum, ['l'] = class_alnum,
+    ['m'] = class_alnum, ['n'] = class_alnum, ['o'] = class_alnum,
+    ['p'] = class_alnum, ['q'] = class_alnum, ['r'] = class_alnum,
+    ['s'] = class_alnum, ['t'] = class_alnum, ['u'] = class_alnum,
+    ['v'] = class_alnum, ['w'] = class_alnum, ['x'] = class_alnum,
+    ['y'] = class_alnum, ['z'] = class_alnum,
+};
 
-    switch(state){
-        case state_plaintext:
-        case state_not_alpha_or_escape:
-        case state_macro_end:
-            if(c == '\\') {
-                state = state_escape;
-            } else {
-                state = state_plaintext;
-            }
-            break;
+#define GO(s) { state_##s, act_none }
+#define DO(s, a) { state_##s, act_##a }
+#define COMMENT DO(comment, comment)
 
-        case state_escape:
-            if(isalnum(c)) {
-                state = state_macro;
-            } else if (isescapechar(c)) {
-                state = state_plaintext;
-            } else {
-                state = state_not_alpha_or_escape;
-            }
-            break;
-        
-        case state_comment:
-            if(c == '\n') {
-                state = state_after_comment;
-            } else {
-                state = state_comment;
-            }
-            
-            break;
-        case state_after_comment:
-            if(c == '\t' || c == ' ') {
-                break;
-            }
-            state = prev_state;
-            tick(c, arg_max);
-            break;
+/* A row lists the transitions for each class, in class_t order */
+#define ROW(other, alnum, blank, newline, backslash, percent, open, close, hash) \
+    { other, alnum, blank, newline, backslash, percent, open, close, hash }
 
-        case state_macro:
-            if(c == '{') {
-                assert(!balanced_paren(true));
-                state = state_argument1_begin;
-            } else {
-                if(!isalnum(c)) {
-                    DIE("%s", "Macro not alphanumeric.");
-                }
-                state = state_macro;
-            }
-            break;
-        
-        case state_argument1:
-        case state_argument2:
-        case state_argument3:
-            if (c == '\\') {
-                if (state == state_argument1) {
-                    state = state_argument1_escape;
-                    break;
-                } else if (state == state_argument2) {
-                    state = state_argument2_escape;
-                    break;
-                } else if (state == state_argument3) {
-                    state = state_argument3_escape;
-                    break;
-                }
-            } else if(c == '{') {
-                assert(!balanced_paren(true));
-            } else if (c == '}') {
-                if(balanced_paren(false)) {
-                    switch(arg_max) {
-                        case 1:
-                            state = state_macro_end;
-                            break;
-                        case 2:
-                            if(state == state_argument2) {
-                                state = state_macro_end;
-                            } else {
-                                state = state_argument1_end;
-                            }
-                            break;
-                        case 3:
-                            if(state == state_argument3) {
-                                state = state_macro_end;
-                            } else if (state == state_argument1) {
-                                state = state_argument1_end;
-                            } else {
-                                state = state_argument2_end;
-                            }
-                            break;
-                    }
-                }
-            }
-            break;
+/* Rows for plain text, an escape and a comment */
+#define PLAIN_ROW ROW(GO(plaintext), GO(plaintext), GO(plaintext), GO(plaintext), \
+    GO(escape), COMMENT, GO(plaintext), GO(plaintext), GO(plaintext))
+#define NOT_MACRO DO(macro, bad_macro)
 
-        case state_argument1_escape:
-            state = state_argument1;
-            break;
-        case state_argument2_escape:
-            state = state_argument2;
-            break;
-        case state_argument3_escape:
-            state = state_argument3;
-            break;
-            
+/* Inside argument N: '}' that balances the braces ends the argument, and the
+macro too once all K of its arguments are read */
+#define CLOSE(n, k) { (k) == 0 ? state_argument##n : (k) == (n) || (k) == 1 \
+    ? state_macro_end : (n) == 1 || (k) == 2 ? state_argument1_end \
+    : state_argument2_end, act_close }
+#define ARG_ROW(n, k) ROW(GO(argument##n), GO(argument##n), GO(argument##n), \
+    GO(argument##n), GO(argument##n##_escape), COMMENT, DO(argument##n, open), \
+    CLOSE(n, k), GO(argument##n))
+#define ARG_ESCAPE_ROW(n) ROW(GO(argument##n), GO(argument##n), GO(argument##n), \
+    GO(argument##n), GO(argument##n), COMMENT, GO(argument##n), GO(argument##n), \
+    GO(argument##n))
+#define BEGIN_CLOSE(n, k) { (k) == (n) || (n) == 3 ? state_macro_end \
+    : (n) == 1 ? state_argument1_end : state_argument2_end, act_close }
+#define ARG_BEGIN_ROW(n, k) ROW(GO(argument##n), GO(argument##n), GO(argument##n), \
+    GO(argument##n), GO(argument##n##_escape), COMMENT, DO(argument##n, open), \
+    BEGIN_CLOSE(n, k), GO(argument##n))
 
-        case state_argument1_begin:
-            if (c == '\\') {
-                state = state_argument1_escape;
-                break;
-            }
-            if(c == '{') {
-                assert(!balanced_paren(true));
-            }
-            if(c == '}') {
-                assert(balanced_paren(false));
-                if(arg_max == 1) {
-                    state = state_macro_end;
-                } else {
-                    state = state_argument1_end;
-                }
-            } else {
-                state = state_argument1;
-            }
-            break;
-        case state_argument2_begin:
-            if (c == '\\') {
-                state = state_argument2_escape;
-                break;
-            }
-            if(c == '{') {
-                assert(!balanced_paren(true));
-            }
-            if(c == '}') {
-                assert(balanced_paren(false));
-                if(arg_max == 2) {
-                    state = state_macro_end;
-                } else {
-                    state = state_argument2_end;
-                }
-            } else {
-                state = state_argument2;
-            }
-            break;
-        case state_argument3_begin:
-            if (c == '\\') {
-                state = state_argument3_escape;
-                break;
-            }
-            if(c == '{') {
-                assert(!balanced_paren(true));
-            }
-            if(c == '}') {
-                assert(balanced_paren(false));
-                state = state_macro_end;
-            } else {
-                state = state_argument3;
-            }
-            break;
+/* After argument N: the macro is over if it takes K == N arguments, otherwise
+the next argument must open */
+#define END(n, k, s) { (k) == (n) ? state_macro_end : state_argument##n##_end, \
+    (k) == (n) ? act_none : act_##s }
+#define END_OPEN(n, k, next) { (k) == (n) ? state_macro_end : state_##next, \
+    (k) == (n) ? act_none : act_open }
+#define ARG_END_ROW(n, k, next) ROW(END(n, k, expect_open), END(n, k, expect_open), \
+    END(n, k, expect_open), END(n, k, expect_open), END(n, k, expect_open), COMMENT, \
+    END_OPEN(n, k, next), END(n, k, expect_open), END(n, k, expect_open))
 
-        case state_argument1_end:
-            if(arg_max == 1) {
-                state = state_macro_end;
-            } else {
-                if(c != '{') {
-                    DIE("%s", "Expected {.");
-                }
-                assert(!balanced_paren(true));
-                state = state_argument2_begin;
+/* Transitions of every state for macros taking K arguments */
+#define TRANSITIONS(k) { \
+    [state_plaintext] = PLAIN_ROW, \
+    [state_not_alpha_or_escape] = PLAIN_ROW, \
+    [state_macro_end] = PLAIN_ROW, \
+    [state_escape] = ROW(GO(not_alpha_or_escape), GO(macro), GO(not_alpha_or_escape), \
+        GO(not_alpha_or_escape), GO(plaintext), GO(plaintext), GO(plaintext), \
+        GO(plaintext), GO(plaintext)), \
+    [state_comment] = ROW(GO(comment), GO(comment), GO(comment), GO(after_comment), \
+        GO(comment), COMMENT, GO(comment), GO(comment), GO(comment)), \
+    [state_after_comment] = ROW(DO(after_comment, resume), DO(after_comment, resume), \
+        GO(after_comment), DO(after_comment, resume), DO(after_comment, resume), \
+        COMMENT, DO(after_comment, resume), DO(after_comment, resume), \
+        DO(after_comment, resume)), \
+    [state_macro] = ROW(NOT_MACRO, GO(macro), NOT_MACRO, NOT_MACRO, NOT_MACRO, \
+        COMMENT, DO(argument1_begin, open), NOT_MACRO, NOT_MACRO), \
+    [state_argument1_begin] = ARG_BEGIN_ROW(1, k), \
+    [state_argument1] = ARG_ROW(1, k), \
+    [state_argument1_escape] = ARG_ESCAPE_ROW(1), \
+    [state_argument1_end] = ARG_END_ROW(1, k, argument2_begin), \
+    [state_argument2_begin] = ARG_BEGIN_ROW(2, k), \
+    [state_argument2] = ARG_ROW(2, k), \
+    [state_argument2_escape] = ARG_ESCAPE_ROW(2), \
+    [state_argument2_end] = ARG_END_ROW(2, k, argument3_begin), \
+    [state_argument3_begin] = ARG_BEGIN_ROW(3, k), \
+    [state_argument3] = ARG_ROW(3, k), \
+    [state_argument3_escape] = ARG_ESCAPE_ROW(3), \
+}
+
+/* Transition table indexed by argument count, state and character class */
+static const transition_t transitions[ARG_MAX_COUNT][STATE_COUNT][class_count] = {
+    TRANSITIONS(0), TRANSITIONS(1), TRANSITIONS(2), TRANSITIONS(3),
+};
+
+/* Initialize parser to plain text outside of any macro */
+void initParser(parser_t* parser) {
+    parser->state = state_plaintext;
+    parser->prev_state = state_plaintext;
+    parser->depth = 0;
+}
+
+/* State machine ticker */
+state_t tick(parser_t* parser, char c, int arg_max) {
+    if(arg_max < 0 || arg_max >= ARG_MAX_COUNT) {
+        arg_max = 0;
+    }
+    class_t class = classes[(unsigned char) c];
+    state_t from = parser->state;
+    transition_t t = transitions[arg_max][from][class];
+
+    /* A comment ends at the first character after the newline that is not
+    blank, which is handled by the state the comment interrupted */
+    if(t.action == act_resume) {
+        from = parser->prev_state;
+        t = transitions[arg_max][from][class];
+    }
+
+    switch(t.action) {
+        case act_open:
+            parser->depth++;
+            break;
+        case act_close:
+            if(--parser->depth != 0) {
+                t.next = from;
             }
             break;
-        case state_argument2_end:
-            if(arg_max == 2) {
-                state = state_macro_end;
-            } else {
-                if(c != '{') {
-                    DIE("%s", "Expected {.");
-                }
-                assert(!balanced_paren(true));
-                state = state_argument3_begin;
+        case act_comment:
+            /* A comment opened right after another resumes where that one would */
+            if(from != state_after_comment) {
+                parser->prev_state = from;
             }
             break;
+        case act_bad_macro:
+            DIE("%s", "Macro not alphanumeric.");
+        case act_expect_open:
+            DIE("%s", "Expected {.");
     }
 
-    return state;
+    parser->state = t.next;
+    return parser->state;
 }
 
 /* Print current state */
@@ -19,6 +19,15 @@ typedef enum myenum {
     state_not_alpha_or_escape,
 } state_t;
 
-state_t tick(char c, int arg_max);
+/* Parser state carried from one character to the next */
+typedef struct {
+    state_t state;
+    state_t prev_state;     /* state a comment interrupted */
+    size_t depth;           /* unbalanced '{' in the current macro call */
+} parser_t;
+
+void initParser(parser_t* parser);
+
+state_t tick(parser_t* parser, char c, int arg_max);
 
 void print_state(state_t state, char c);
\ No newline at end of file
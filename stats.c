@@ -0,0 +1,226 @@
+#include "proj1.h"
+#include <stdarg.h>
+#include "statemachine.h"
+#include "macros.h"
+#include "expander.h"
+#include "stats.h"
+
+#define STATS_SIZE 64 // Initial slots for user macros
+
+/* Names of the builtins, indexed by builtin_t */
+static char* builtin_names[] = {
+    NULL, "def", "undef", "if", "ifdef", "include", "expandafter"
+};
+
+/* Initialize statistics with nothing counted yet */
+stats_t* createStats(void) {
+    stats_t* stats = malloc(sizeof(stats_t));
+    for (int i = 0; i <= builtin_expandafter; i++) {
+        stats->builtins[i] = (call_stats_t) { builtin_names[i], 0, true, 0, 0, 0, 0, 0 };
+    }
+    stats->capacity = STATS_SIZE;
+    stats->size = 0;
+    stats->macros = calloc(stats->capacity, sizeof(call_stats_t*));
+    stats->open = NULL;
+    stats->open_count = 0;
+    stats->open_capacity = 0;
+    stats->max_depth = 0;
+    stats->counters = (counters_t) { 0, 0, 0, 0 };
+    return stats;
+}
+
+/* Double the hash table, moving every entry to its new slot */
+static void statsRehash(stats_t* stats) {
+    size_t capacity = 2 * stats->capacity;
+    call_stats_t** macros = calloc(capacity, sizeof(call_stats_t*));
+    for (size_t i = 0; i < stats->capacity; i++) {
+        call_stats_t* c = stats->macros[i];
+        if (c) {
+            size_t j = c->hash & (capacity - 1);
+            while (macros[j]) {
+                j = (j + 1) & (capacity - 1);
+            }
+            macros[j] = c;
+        }
+    }
+    free(stats->macros);
+    stats->macros = macros;
+    stats->capacity = capacity;
+}
+
+/* Find the statistics of BUILTIN, or unless it is builtin_none, of the user
+macro NAME with hash HASH, adding them if the macro was not called before */
+call_stats_t* statsFind(stats_t* stats, string_t* name, size_t hash, builtin_t builtin) {
+    if (builtin != builtin_none) {
+        return &stats->builtins[builtin];
+    }
+    size_t i = hash & (stats->capacity - 1);
+    for (call_stats_t* c; (c = stats->macros[i]) != NULL; i = (i + 1) & (stats->capacity - 1)) {
+        if (c->hash == hash && !strcmp(c->name, name->data)) {
+            return c;
+        }
+    }
+
+    call_stats_t* c = malloc(sizeof(call_stats_t));
+    *c = (call_stats_t) { strdup(name->data), hash, false, 0, 0, 0, 0, 0 };
+    stats->macros[i] = c;
+    if (2 * ++stats->size > stats->capacity) {
+        statsRehash(stats);
+    }
+    return c;
+}
+
+/* Start timing CALL, just read, until its expansion runs out; it stays open,
+tied to no entry yet, until it is ended or given the entry its expansion goes
+into */
+void statsBegin(stats_t* stats, call_stats_t* call) {
+    if (stats->open_count >= stats->open_capacity) {
+        stats->open_capacity = stats->open_capacity ? 2 * stats->open_capacity : 64;
+        stats->open = realloc(stats->open, stats->open_capacity * sizeof(open_call_t));
+    }
+    call->active++;
+    stats->open[stats->open_count++] = (open_call_t) { call, 0, monotonicClock() };
+}
+
+/* Keep the call begun last open until the stack entry DEPTH deep, which
+holds its expansion, is popped */
+void statsOpen(stats_t* stats, size_t depth) {
+    stats->open[stats->open_count - 1].depth = depth;
+}
+
+/* End the innermost open call, adding its time to its macro's total unless
+the macro is active further out */
+void statsEnd(stats_t* stats) {
+    open_call_t* open = &stats->open[--stats->open_count];
+    if (--open->call->active == 0) {
+        open->call->total_nanoseconds += monotonicClock() - open->start;
+    }
+}
+
+/* End the innermost open call if the stack entry DEPTH deep, about to be
+popped, holds its expansion */
+void statsPop(stats_t* stats, size_t depth) {
+    if (stats->open_count > 0 && stats->open[stats->open_count - 1].depth == depth) {
+        statsEnd(stats);
+    }
+}
+
+/* End every open call, as the expansion they were part of was abandoned */
+void statsUnwind(stats_t* stats) {
+    while (stats->open_count > 0) {
+        statsEnd(stats);
+    }
+}
+
+/* Record the deepest STACK has been, before it is destroyed */
+void statsStack(stats_t* stats, stack_t* stack) {
+    if (stack->max_depth > stats->max_depth) {
+        stats->max_depth = stack->max_depth;
+    }
+}
+
+/* Add what this thread's counters went up by since they read BEFORE */
+void statsCounters(stats_t* stats, const counters_t* before) {
+    stats->counters.mallocs += counters.mallocs - before->mallocs;
+    stats->counters.reallocs += counters.reallocs - before->reallocs;
+    stats->counters.pushes += counters.pushes - before->pushes;
+    stats->counters.pops += counters.pops - before->pops;
+}
+
+/* Orders calls by total time, then time, then count, then name, most
+expensive first */
+static int compareCalls(const void* a, const void* b) {
+    const call_stats_t* x = *(call_stats_t* const*) a;
+    const call_stats_t* y = *(call_stats_t* const*) b;
+    if (x->total_nanoseconds != y->total_nanoseconds) {
+        return x->total_nanoseconds < y->total_nanoseconds ? 1 : -1;
+    }
+    if (x->nanoseconds != y->nanoseconds) {
+        return x->nanoseconds < y->nanoseconds ? 1 : -1;
+    }
+    if (x->calls != y->calls) {
+        return x->calls < y->calls ? 1 : -1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+/* Formats part of a line of the report onto OUTPUT; names, which can be of
+any length, are written with statsName instead */
+static void statsPrint(sink_t* output, const char* format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(line, sizeof line, format, args);
+    va_end(args);
+    sinkBytes(output, line, n);
+}
+
+/* Writes NAME onto OUTPUT, padded with spaces to WIDTH bytes */
+static void statsName(sink_t* output, const char* name, size_t width) {
+    size_t size = strlen(name);
+    sinkBytes(output, name, size);
+    for (; size < width; size++) {
+        sinkChar(output, ' ');
+    }
+}
+
+/* Write a report of every macro and builtin called, longest running first, to
+OUTPUT: a table, or JSON if JSON is true. Macro names are letters and digits
+only, so need no escaping */
+void writeStats(stats_t* stats, bool json, sink_t* output) {
+    call_stats_t** calls = malloc((stats->size + builtin_expandafter) * sizeof(call_stats_t*));
+    size_t count = 0;
+    for (int i = builtin_none + 1; i <= builtin_expandafter; i++) {
+        if (stats->builtins[i].calls > 0) {
+            calls[count++] = &stats->builtins[i];
+        }
+    }
+    for (size_t i = 0; i < stats->capacity; i++) {
+        if (stats->macros[i]) {
+            calls[count++] = stats->macros[i];
+        }
+    }
+    qsort(calls, count, sizeof(call_stats_t*), compareCalls);
+
+    counters_t* c = &stats->counters;
+    if (json) {
+        statsPrint(output, "{\"macros\": [");
+        for (size_t i = 0; i < count; i++) {
+            statsPrint(output, "%s\n  {\"name\": \"", i ? "," : "");
+            statsName(output, calls[i]->name, 0);
+            statsPrint(output, "\", \"builtin\": %s, \"calls\": %zu, \"bytes\": %zu, "
+                "\"total_nanoseconds\": %lld, \"nanoseconds\": %lld}",
+                calls[i]->builtin ? "true" : "false", calls[i]->calls, calls[i]->bytes,
+                calls[i]->total_nanoseconds, calls[i]->nanoseconds);
+        }
+        statsPrint(output, "],\n \"max_stack_depth\": %zu, \"pushes\": %zu, \"pops\": %zu, "
+            "\"string_mallocs\": %zu, \"string_reallocs\": %zu}\n", stats->max_depth,
+            c->pushes, c->pops, c->mallocs, c->reallocs);
+    } else {
+        statsPrint(output, "%-24s %12s %14s %12s %12s\n", "macro", "calls", "bytes",
+            "total ms", "self ms");
+        for (size_t i = 0; i < count; i++) {
+            sinkChar(output, '\\');
+            statsName(output, calls[i]->name, 23);
+            statsPrint(output, " %12zu %14zu %12.3f %12.3f\n", calls[i]->calls,
+                calls[i]->bytes, calls[i]->total_nanoseconds / 1e6, calls[i]->nanoseconds / 1e6);
+        }
+        statsPrint(output, "max stack depth %zu, %zu pushes, %zu pops, "
+            "%zu string mallocs, %zu string reallocs\n", stats->max_depth,
+            c->pushes, c->pops, c->mallocs, c->reallocs);
+    }
+    free(calls);
+}
+
+/* Destroy statistics and the names they kept */
+void destroyStats(stats_t* stats) {
+    for (size_t i = 0; i < stats->capacity; i++) {
+        if (stats->macros[i]) {
+            free(stats->macros[i]->name);
+            free(stats->macros[i]);
+        }
+    }
+    free(stats->macros);
+    free(stats->open);
+    free(stats);
+}
@@ -0,0 +1,66 @@
+/* ----------------------------------------------------------------------------
+Expansion Statistics
+---------------------------------------------------------------------------- */
+
+/* Calls of one macro or builtin, the bytes their expansions came to, the
+nanoseconds spent making them and the nanoseconds until their expansions ran
+out, calls in them included; a call made while the same macro is ACTIVE
+further out adds to no total, so recursion is counted once */
+typedef struct {
+    char* name;
+    size_t hash;
+    bool builtin;
+    size_t calls;
+    size_t bytes;
+    long long nanoseconds;
+    long long total_nanoseconds;
+    size_t active;
+} call_stats_t;
+
+/* A call not yet ended, with the stack depth of the entry holding its
+expansion, or 0 while it is still being processed */
+typedef struct {
+    call_stats_t* call;
+    size_t depth;
+    long long start;
+} open_call_t;
+
+/* What the expansions of one context have done so far: the builtins in
+BUILTINS, indexed by builtin_t, and user macros in an open-addressing hash
+table of CAPACITY slots (a power of two), with the most entries the expansion
+stack held at once and the difference the expansions made to the counters.
+OPEN holds the calls whose expansions are still on the stack, innermost last,
+as the trace does */
+typedef struct stats {
+    call_stats_t builtins[builtin_expandafter + 1];
+    call_stats_t** macros;
+    size_t size;
+    size_t capacity;
+    open_call_t* open;
+    size_t open_count;
+    size_t open_capacity;
+    size_t max_depth;
+    counters_t counters;
+} stats_t;
+
+stats_t* createStats(void);
+
+call_stats_t* statsFind(stats_t* stats, string_t* name, size_t hash, builtin_t builtin);
+
+void statsBegin(stats_t* stats, call_stats_t* call);
+
+void statsOpen(stats_t* stats, size_t depth);
+
+void statsEnd(stats_t* stats);
+
+void statsPop(stats_t* stats, size_t depth);
+
+void statsUnwind(stats_t* stats);
+
+void statsStack(stats_t* stats, stack_t* stack);
+
+void statsCounters(stats_t* stats, const counters_t* before);
+
+void writeStats(stats_t* stats, bool json, sink_t* output);
+
+void destroyStats(stats_t* stats);
@@ -0,0 +1,41 @@
+#!/bin/sh
+# Expands a loop of a million tail calls with PROJ1 and checks that all of
+# them ran, and that the expansion stack stayed shallow throughout: each of
+# 1000 outer steps \aI runs an inner chain \b0 ... \b1000 of 1000 calls, which
+# hands back through \next, redefined by each outer step to call the next one
+# usage: tests/tail.sh PROJ1
+
+proj1=${1:-./proj1}
+depth_limit=8
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+awk 'BEGIN {
+    n = 1000
+    printf "\\def{next}{}"
+    for (i = 0; i < n; i++) {
+        printf "\\def{a%d}{\\undef{next}\\def{next}{\\a%d{}}\\b0{}}", i, i + 1
+    }
+    printf "\\def{a%d}{.}", n
+    for (j = 0; j < n; j++) {
+        printf "\\def{b%d}{x\\b%d{}}", j, j + 1
+    }
+    printf "\\def{b%d}{\\next{}}\\a0{}\n", n
+}' > "$dir/loop.tex"
+awk 'BEGIN { for (i = 0; i < 1000; i++) { for (j = 0; j < 1000; j++) printf "x" } print "." }' > "$dir/expected"
+
+if ! "$proj1" --stats "$dir/loop.tex" > "$dir/output" 2> "$dir/stats"; then
+    echo "tail: $proj1 failed" >&2
+    cat "$dir/stats" >&2
+    exit 1
+fi
+if ! cmp -s "$dir/output" "$dir/expected"; then
+    echo "tail: output differs from a million x's and a period" >&2
+    exit 1
+fi
+depth=$(sed -n 's/^max stack depth \([0-9]*\),.*/\1/p' "$dir/stats")
+if [ -z "$depth" ] || [ "$depth" -gt "$depth_limit" ]; then
+    echo "tail: max stack depth ${depth:-missing}, expected at most $depth_limit" >&2
+    exit 1
+fi
+echo "tail: ok, 1000000 tail calls at max stack depth $depth"
@@ -0,0 +1,261 @@
+#include "proj1.h"
+#include "statemachine.h"
+#include "macros.h"
+#include "expander.h"
+#include "stats.h"
+#include "trace.h"
+#include "texmacro.h"
+
+/* An expander, with the output callback of the call in progress */
+struct texmacro {
+    expander_t* expander;
+    texmacro_base_t* base;
+    bool started;
+    texmacro_write_t write;
+    void* ctx;
+};
+
+static _Thread_local char error[256];
+
+/* Why the last call that failed on this thread did */
+const char* texmacroError(void) {
+    return error;
+}
+
+/* Ends a call whose trap caught a failure: puts back the trap of any caller,
+and records why for texmacroError */
+static int caught(trap_t* outer, trap_t* here) {
+    trap = outer;
+    snprintf(error, sizeof error, "%s", here->message);
+    return -1;
+}
+
+/* Load the macros a snapshot holds, then expand a preamble file on top of
+them; either may be NULL. Returns NULL if either cannot be loaded */
+texmacro_base_t* texmacroLoadBase(const char* snapshot, const char* preamble) {
+    trap_t here;
+    trap_t* outer = trap;
+    macro_list_t* volatile macros = NULL;
+    texmacro_base_t* base;
+
+    trap = &here;
+    if (setjmp(here.env) != 0) {
+        caught(outer, &here);
+        if (macros) {
+            destroyMacroList(macros);
+        }
+        return NULL;
+    }
+    macros = snapshot ? loadMacros((char*) snapshot) : NULL;
+    if (preamble) {
+        base = loadPreamble((char*) preamble, macros);
+    } else {
+        base = createPreamble(macros ? macros : createMacroList());
+        freezeMacroList(base->macros);
+    }
+    trap = outer;
+    return base;
+}
+
+/* Destroy a base once no context uses it any more */
+void texmacroDestroyBase(texmacro_base_t* base) {
+    destroyPreamble(base);
+}
+
+/* Initialize a context with a macro table of its own, on top of BASE unless
+BASE is NULL; its first document starts with the output of BASE */
+texmacro_t* texmacroCreate(texmacro_base_t* base) {
+    texmacro_t* tm = malloc(sizeof(texmacro_t));
+    tm->expander = createExpander(base ? base->macros : NULL);
+    tm->base = base;
+    tm->started = false;
+    tm->write = NULL;
+    tm->ctx = NULL;
+    return tm;
+}
+
+/* Define NAME as DEFINITION, as \def{NAME}{DEFINITION} would */
+int texmacroDefine(texmacro_t* tm, const char* name, const char* definition) {
+    string_t n = { (char*) name, strlen(name), 0 };
+    string_t d = { (char*) definition, strlen(definition), 0 };
+    trap_t here;
+    trap_t* outer = trap;
+
+    trap = &here;
+    if (setjmp(here.env) != 0) {
+        return caught(outer, &here);
+    }
+    macro_def(tm->expander->macros, &n, &d);
+    trap = outer;
+    return 0;
+}
+
+/* Passes a block of output on to the callback of the call in progress; the
+first block of the context starts with the output of its base, so once one is
+passed on, no later document repeats it */
+static void writeCallback(void* arg, const char* data, size_t size) {
+    texmacro_t* tm = arg;
+    tm->started = true;
+    if (tm->write(tm->ctx, data, size) != 0) {
+        DIE("%s", "Cannot write output.");
+    }
+}
+
+/* Starts a document, passing its output on to WRITE with CTX, after the
+output of the base if no document has passed that on yet */
+static sink_t* startDocument(texmacro_t* tm, texmacro_write_t write, void* ctx) {
+    tm->write = write;
+    tm->ctx = ctx;
+    resetExpander(tm->expander);
+    sink_t* output = createSink(writeCallback, tm);
+    if (tm->base && !tm->started) {
+        sinkBytes(output, tm->base->output->data, tm->base->output->size);
+    }
+    return output;
+}
+
+/* Expand the SIZE bytes at TEXT as a whole document, passing the output on
+to WRITE with CTX in blocks; the text is read in place, never copied, and
+macros it defines stay defined for later documents of the context */
+int texmacroExpand(texmacro_t* tm, const char* text, size_t size,
+    texmacro_write_t write, void* ctx) {
+    string_t document = { (char*) text, size, size };
+    sink_t* output = startDocument(tm, write, ctx);
+    trap_t here;
+    trap_t* outer = trap;
+
+    trap = &here;
+    if (setjmp(here.env) != 0) {
+        /* Drop whatever the failed document had not yet passed on, and
+        end the calls it left open */
+        output->buffer->size = 0;
+        destroySink(output);
+        resetExpander(tm->expander);
+        return caught(outer, &here);
+    }
+    if (!validEnd(expand(tm->expander, &document, output))) {
+        DIE("%s", "invalid end");
+    }
+    sinkFlush(output);
+    trap = outer;
+    destroySink(output);
+    return 0;
+}
+
+/* Expand the COUNT files named by FILES as one document, or standard input
+if COUNT is 0, streaming them in as the output is passed on to WRITE */
+int texmacroExpandFiles(texmacro_t* tm, char** files, int count,
+    texmacro_write_t write, void* ctx) {
+    source_t* input = createSource(files, count);
+    sink_t* output = startDocument(tm, write, ctx);
+    trap_t here;
+    trap_t* outer = trap;
+
+    trap = &here;
+    if (setjmp(here.env) != 0) {
+        output->buffer->size = 0;
+        destroySink(output);
+        destroySource(input);
+        resetExpander(tm->expander);
+        return caught(outer, &here);
+    }
+    if (!validEnd(expandSource(tm->expander, input, output))) {
+        DIE("%s", "invalid end");
+    }
+    sinkFlush(output);
+    trap = outer;
+    destroySink(output);
+    destroySource(input);
+    return 0;
+}
+
+/* Save every macro the context can see in a snapshot texmacroLoadBase can
+load */
+int texmacroDump(texmacro_t* tm, const char* snapshot) {
+    trap_t here;
+    trap_t* outer = trap;
+
+    trap = &here;
+    if (setjmp(here.env) != 0) {
+        return caught(outer, &here);
+    }
+    dumpMacros(tm->expander->macros, (char*) snapshot);
+    trap = outer;
+    return 0;
+}
+
+/* Count calls per macro, with the bytes and time they take, and how deep the
+expansion stack goes, from the next document on; off unless asked for, as it
+times every call */
+void texmacroCollectStats(texmacro_t* tm) {
+    if (tm->expander->stats == NULL) {
+        tm->expander->stats = createStats();
+    }
+}
+
+/* Pass a report of what has been counted since texmacroCollectStats on to
+WRITE with CTX, most expensive macros first: a table, or JSON if JSON is
+nonzero */
+int texmacroWriteStats(texmacro_t* tm, int json, texmacro_write_t write, void* ctx) {
+    if (tm->expander->stats == NULL) {
+        snprintf(error, sizeof error, "%s", "Statistics are not being collected.");
+        return -1;
+    }
+    tm->write = write;
+    tm->ctx = ctx;
+    sink_t* output = createSink(writeCallback, tm);
+    trap_t here;
+    trap_t* outer = trap;
+
+    trap = &here;
+    if (setjmp(here.env) != 0) {
+        output->buffer->size = 0;
+        destroySink(output);
+        return caught(outer, &here);
+    }
+    writeStats(tm->expander->stats, json, output);
+    sinkFlush(output);
+    trap = outer;
+    destroySink(output);
+    return 0;
+}
+
+/* Record each call from the next document on as it begins and ends, keeping
+the last EVENTS events, or a default number if EVENTS is 0 */
+void texmacroCollectTrace(texmacro_t* tm, size_t events) {
+    if (tm->expander->trace == NULL) {
+        tm->expander->trace = createTrace(events);
+    }
+}
+
+/* Pass the events recorded since texmacroCollectTrace on to WRITE with CTX
+as Chrome trace-event JSON */
+int texmacroWriteTrace(texmacro_t* tm, texmacro_write_t write, void* ctx) {
+    if (tm->expander->trace == NULL) {
+        snprintf(error, sizeof error, "%s", "Calls are not being traced.");
+        return -1;
+    }
+    tm->write = write;
+    tm->ctx = ctx;
+    sink_t* output = createSink(writeCallback, tm);
+    trap_t here;
+    trap_t* outer = trap;
+
+    trap = &here;
+    if (setjmp(here.env) != 0) {
+        output->buffer->size = 0;
+        destroySink(output);
+        return caught(outer, &here);
+    }
+    writeTrace(tm->expander->trace, output);
+    sinkFlush(output);
+    trap = outer;
+    destroySink(output);
+    return 0;
+}
+
+/* Destroy a context and the macros it defined */
+void texmacroDestroy(texmacro_t* tm) {
+    destroyExpander(tm->expander);
+    free(tm);
+}
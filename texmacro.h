@@ -0,0 +1,52 @@
+/* ----------------------------------------------------------------------------
+Embedding API
+
+Expands documents in-process. Every call that can fail returns 0 on success,
+or -1 with the reason left for texmacroError; none of them exits. A base may
+be shared by any number of contexts on any threads, and must outlive them; a
+context belongs to one thread at a time.
+---------------------------------------------------------------------------- */
+
+#include <stddef.h>
+
+/* The library is built with hidden visibility; only these entry points are
+exported from libtexmacro.so */
+#define TEXMACRO_API __attribute__((visibility("default")))
+
+/* Macros (and output) loaded once and shared by many documents */
+typedef struct preamble texmacro_base_t;
+
+/* A macro table of its own, on top of a base if it has one */
+typedef struct texmacro texmacro_t;
+
+/* Receives each block of output as it is produced; a nonzero return stops
+the expansion with a write error */
+typedef int (*texmacro_write_t)(void* ctx, const char* data, size_t size);
+
+TEXMACRO_API const char* texmacroError(void);
+
+TEXMACRO_API texmacro_base_t* texmacroLoadBase(const char* snapshot, const char* preamble);
+
+TEXMACRO_API void texmacroDestroyBase(texmacro_base_t* base);
+
+TEXMACRO_API texmacro_t* texmacroCreate(texmacro_base_t* base);
+
+TEXMACRO_API int texmacroDefine(texmacro_t* tm, const char* name, const char* definition);
+
+TEXMACRO_API int texmacroExpand(texmacro_t* tm, const char* text, size_t size,
+    texmacro_write_t write, void* ctx);
+
+TEXMACRO_API int texmacroExpandFiles(texmacro_t* tm, char** files, int count,
+    texmacro_write_t write, void* ctx);
+
+TEXMACRO_API int texmacroDump(texmacro_t* tm, const char* snapshot);
+
+TEXMACRO_API void texmacroCollectStats(texmacro_t* tm);
+
+TEXMACRO_API int texmacroWriteStats(texmacro_t* tm, int json, texmacro_write_t write, void* ctx);
+
+TEXMACRO_API void texmacroCollectTrace(texmacro_t* tm, size_t events);
+
+TEXMACRO_API int texmacroWriteTrace(texmacro_t* tm, texmacro_write_t write, void* ctx);
+
+TEXMACRO_API void texmacroDestroy(texmacro_t* tm);
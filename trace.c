@@ -0,0 +1,152 @@
+#include "proj1.h"
+#include "statemachine.h"
+#include "macros.h"
+#include "expander.h"
+#include "trace.h"
+
+
+/* Categories of the events, indexed by builtin_t */
+static const char* categories[] = {
+    "macro", "builtin", "builtin", "builtin", "builtin", "include", "expandafter"
+};
+
+/* Initialize a trace keeping the last CAPACITY events, or TRACE_EVENTS if
+CAPACITY is 0, with the ring allocated and touched up front */
+trace_t* createTrace(size_t capacity) {
+    trace_t* trace = malloc(sizeof(trace_t));
+    trace->capacity = capacity ? capacity : TRACE_EVENTS;
+    trace->events = malloc(trace->capacity * sizeof(trace_event_t));
+
+    /* Fault the ring in now rather than while calls are being timed */
+    memset(trace->events, 0, trace->capacity * sizeof(trace_event_t));
+    trace->count = 0;
+    trace->start = monotonicClock();
+    trace->open = malloc(TRACE_OPEN * sizeof(size_t));
+    trace->open_count = 0;
+    trace->unrecorded = 0;
+    return trace;
+}
+
+/* Take the next slot of the ring, stamped with the time */
+static trace_event_t* traceNext(trace_t* trace, char phase) {
+    trace_event_t* event = &trace->events[trace->count++ % trace->capacity];
+    event->time = monotonicClock() - trace->start;
+    event->phase = phase;
+    return event;
+}
+
+/* Record the start of the call CTX has just read, made with the expansion
+stack DEPTH entries deep; it stays open, tied to no entry yet, until it is
+ended or given the entry its expansion goes into. Returns false, counting the
+call as unrecorded, if TRACE_OPEN calls are open already: it then has no
+events at all */
+bool traceBegin(trace_t* trace, expander_t* ctx, size_t depth) {
+    if (trace->open_count >= TRACE_OPEN) {
+        trace->unrecorded++;
+        return false;
+    }
+    trace_event_t* event = traceNext(trace, 'B');
+    event->builtin = ctx->builtin;
+    event->depth = depth;
+    event->args[0] = ctx->arg1.size;
+    event->args[1] = ctx->arg2.size;
+    event->args[2] = ctx->arg3.size;
+
+    /* A long file name keeps its end, where it differs most */
+    string_t* name = ctx->builtin == builtin_include ? &ctx->arg1 : &ctx->macro_name;
+    size_t size = name->size < TRACE_NAME ? name->size : TRACE_NAME - 1;
+    memcpy(event->name, name->data + name->size - size, size);
+    event->name[size] = '\0';
+
+    trace->open[trace->open_count++] = 0;
+    return true;
+}
+
+/* Keep the call begun last open until the stack entry DEPTH deep, which
+holds its expansion, is popped */
+void traceOpen(trace_t* trace, size_t depth) {
+    trace->open[trace->open_count - 1] = depth;
+}
+
+/* Record the end of the innermost open call */
+void traceEnd(trace_t* trace) {
+    trace->open_count--;
+    traceNext(trace, 'E');
+}
+
+/* End the innermost open call if the stack entry DEPTH deep, about to be
+popped, holds its expansion */
+void tracePop(trace_t* trace, size_t depth) {
+    if (trace->open_count > 0 && trace->open[trace->open_count - 1] == depth) {
+        traceEnd(trace);
+    }
+}
+
+/* End every open call, as the expansion they were part of was abandoned */
+void traceUnwind(trace_t* trace) {
+    while (trace->open_count > 0) {
+        traceEnd(trace);
+    }
+}
+
+/* Writes S to OUTPUT as the contents of a JSON string */
+static void traceString(sink_t* output, const char* s) {
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            sinkChar(output, '\\');
+            sinkChar(output, *s);
+        } else if ((unsigned char) *s < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof escape, "\\u%04x", (unsigned char) *s);
+            sinkBytes(output, escape, 6);
+        } else {
+            sinkChar(output, *s);
+        }
+    }
+}
+
+/* Write the events kept to OUTPUT in the Chrome trace-event format, which
+Perfetto and chrome://tracing load; an end whose beginning was overwritten is
+left out, so that the rest still nest */
+void writeTrace(trace_t* trace, sink_t* output) {
+    size_t first = trace->count > trace->capacity ? trace->count - trace->capacity : 0;
+    size_t open = 0;
+    bool comma = false;
+    char line[256];
+    sinkBytes(output, "{\"traceEvents\": [", 17);
+    for (size_t i = first; i < trace->count; i++) {
+        trace_event_t* event = &trace->events[i % trace->capacity];
+        int n;
+        if (event->phase == 'E') {
+            if (open == 0) {
+                continue;
+            }
+            open--;
+            n = snprintf(line, sizeof line, "%s\n{\"ph\": \"E\", \"ts\": %.3f, \"pid\": 1, \"tid\": 1}",
+                comma ? "," : "", event->time / 1e3);
+            sinkBytes(output, line, n);
+        } else {
+            open++;
+            n = snprintf(line, sizeof line, "%s\n{\"ph\": \"B\", \"cat\": \"%s\", \"name\": \"",
+                comma ? "," : "", categories[event->builtin]);
+            sinkBytes(output, line, n);
+            traceString(output, event->name);
+            n = snprintf(line, sizeof line, "\", \"ts\": %.3f, \"pid\": 1, \"tid\": 1, "
+                "\"args\": {\"depth\": %zu, \"arg1\": %zu, \"arg2\": %zu, \"arg3\": %zu}}",
+                event->time / 1e3, event->depth, event->args[0], event->args[1], event->args[2]);
+            sinkBytes(output, line, n);
+        }
+        comma = true;
+    }
+    int n = snprintf(line, sizeof line, "\n], \"displayTimeUnit\": \"ns\", "
+        "\"otherData\": {\"events\": %zu, \"dropped\": %zu, \"unrecorded_calls\": %zu}}\n",
+        trace->count, first, trace->unrecorded);
+    sinkBytes(output, line, n);
+}
+
+/* Destroy a trace and its events */
+void destroyTrace(trace_t* trace) {
+    free(trace->events);
+    free(trace->open);
+    free(trace);
+}
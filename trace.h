@@ -0,0 +1,50 @@
+/* ----------------------------------------------------------------------------
+Expansion Trace
+---------------------------------------------------------------------------- */
+
+#define TRACE_EVENTS (1 << 18) // Events a trace keeps unless told otherwise
+#define TRACE_NAME 32          // Bytes of a name kept with its event
+#define TRACE_OPEN 4096        // Calls a trace can follow open at once
+
+/* A call beginning, with what it was called with, or the innermost call
+ending; TIME is in nanoseconds from the start of the trace */
+typedef struct {
+    long long time;
+    char phase;             /* 'B' or 'E' */
+    builtin_t builtin;
+    size_t depth;           /* of the expansion stack at the call */
+    size_t args[3];         /* bytes in each argument */
+    char name[TRACE_NAME];  /* the macro's, or the included file's */
+} trace_event_t;
+
+/* Events recorded into a ring of CAPACITY allocated up front, the latest
+overwriting the oldest once COUNT passes it, so recording never allocates or
+writes. A call's span ends when the stack entry its expansion went into is
+popped: OPEN, also allocated up front, holds the stack depths of those
+entries, innermost last, or 0 for a call still being processed. Calls begun
+while it is full are left out, and counted as UNRECORDED */
+typedef struct trace {
+    trace_event_t* events;
+    size_t capacity;
+    size_t count;
+    long long start;
+    size_t* open;
+    size_t open_count;
+    size_t unrecorded;
+} trace_t;
+
+trace_t* createTrace(size_t capacity);
+
+bool traceBegin(trace_t* trace, expander_t* ctx, size_t depth);
+
+void traceOpen(trace_t* trace, size_t depth);
+
+void traceEnd(trace_t* trace);
+
+void tracePop(trace_t* trace, size_t depth);
+
+void traceUnwind(trace_t* trace);
+
+void writeTrace(trace_t* trace, sink_t* output);
+
+void destroyTrace(trace_t* trace);